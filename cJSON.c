@@ -30,6 +30,7 @@
 #include <float.h>
 #include <limits.h>
 #include <ctype.h>
+#include <stdint.h>
 #include "cJSON.h"
 
 static const char *ep;
@@ -77,6 +78,83 @@ static cJSON *cJSON_New_Item(void)
 	return node;
 }
 
+/* Object index: an open-addressed (linear probing) hash of an object's children, keyed case-insensitively on ->string.
+   Only the first child with a given name is indexed, matching the linear scan. */
+#define cJSON_INDEX_MIN 16	/* Objects are indexed once a lookup has to walk past this many children. */
+typedef struct {unsigned hash;cJSON *item;} cJSON_IndexEntry;
+struct cJSON_Index {int size,count,dups;cJSON_IndexEntry *slots;};
+
+static unsigned cJSON_hash(const char *s)
+{
+	unsigned h=2166136261u;	/* FNV-1a over the lowercased name. */
+	while (*s) {h^=(unsigned)tolower(*(const unsigned char*)s++);h*=16777619u;}
+	return h;
+}
+
+static void cJSON_IndexFree(struct cJSON_Index *idx) {if (idx) {cJSON_free(idx->slots);cJSON_free(idx);}}
+
+/* Find the slot holding name "string", or the empty slot where it would go. */
+static int cJSON_IndexSlot(struct cJSON_Index *idx,const char *string,unsigned hash)
+{
+	int i=hash&(idx->size-1);
+	while (idx->slots[i].item && (idx->slots[i].hash!=hash || cJSON_strcasecmp(idx->slots[i].item->string,string))) i=(i+1)&(idx->size-1);
+	return i;
+}
+
+static int cJSON_IndexGrow(struct cJSON_Index *idx)
+{
+	cJSON_IndexEntry *old=idx->slots;int i,oldsize=idx->size,size=oldsize?oldsize*2:32;
+	if (!(idx->slots=(cJSON_IndexEntry*)cJSON_malloc(size*sizeof(cJSON_IndexEntry)))) {idx->slots=old;return 0;}
+	memset(idx->slots,0,size*sizeof(cJSON_IndexEntry));idx->size=size;
+	for (i=0;i<oldsize;i++) if (old[i].item)
+	{
+		int j=old[i].hash&(size-1);
+		while (idx->slots[j].item) j=(j+1)&(size-1);
+		idx->slots[j]=old[i];
+	}
+	cJSON_free(old);
+	return 1;
+}
+
+/* Add item to the index. Returns -1 on memory failure, 1 if the name was already indexed (item is then left out), 0 otherwise. */
+static int cJSON_IndexInsert(struct cJSON_Index *idx,cJSON *item)
+{
+	unsigned hash;int i;
+	if (!item->string) return 0;
+	if ((idx->count+1)*2>idx->size && !cJSON_IndexGrow(idx)) return -1;
+	hash=cJSON_hash(item->string);i=cJSON_IndexSlot(idx,item->string,hash);
+	if (idx->slots[i].item) {idx->dups=1;return 1;}
+	idx->slots[i].hash=hash;idx->slots[i].item=item;idx->count++;
+	return 0;
+}
+
+/* Remove item from the index. Returns 0 if the index can no longer be trusted (a shadowed duplicate would now be visible). */
+static int cJSON_IndexRemove(struct cJSON_Index *idx,cJSON *item)
+{
+	int i,j,k,mask=idx->size-1;
+	if (!item->string) return 1;
+	i=cJSON_IndexSlot(idx,item->string,cJSON_hash(item->string));
+	if (idx->slots[i].item!=item) return 1;	/* Not indexed: a shadowed duplicate. */
+	if (idx->dups) return 0;
+	for (j=i;;)	/* Backward-shift deletion keeps probe chains intact without tombstones. */
+	{
+		j=(j+1)&mask;if (!idx->slots[j].item) break;
+		k=idx->slots[j].hash&mask;
+		if ((j>i && (k<=i || k>j)) || (j<i && k<=i && k>j)) {idx->slots[i]=idx->slots[j];i=j;}
+	}
+	idx->slots[i].item=0;idx->count--;
+	return 1;
+}
+
+static struct cJSON_Index *cJSON_IndexBuild(cJSON *object)
+{
+	cJSON *c;struct cJSON_Index *idx=(struct cJSON_Index*)cJSON_malloc(sizeof(struct cJSON_Index));
+	if (!idx) return 0;
+	memset(idx,0,sizeof(struct cJSON_Index));
+	for (c=object->child;c;c=c->next) if (cJSON_IndexInsert(idx,c)<0) {cJSON_IndexFree(idx);return 0;}
+	return idx;
+}
+
 /* Delete a cJSON structure. */
 void cJSON_Delete(cJSON *c)
 {
@@ -85,6 +163,7 @@ void cJSON_Delete(cJSON *c)
 	{
 		next=c->next;
 		if (!(c->type&cJSON_IsReference) && c->child) cJSON_Delete(c->child);
+		if (!(c->type&cJSON_IsReference)) cJSON_IndexFree(c->index);
 		if (!(c->type&cJSON_IsReference) && c->valuestring) cJSON_free(c->valuestring);
 		if (c->string) cJSON_free(c->string);
 		cJSON_free(c);
@@ -92,49 +171,231 @@ void cJSON_Delete(cJSON *c)
 	}
 }
 
-/* Parse the input text to generate a number, and populate the result into item. */
+/* Powers of ten that are exact in a double: multiplying an exact mantissa (<= 2^53) by one of these is correctly rounded. */
+static const double cJSON_pow10[]={1e0,1e1,1e2,1e3,1e4,1e5,1e6,1e7,1e8,1e9,1e10,1e11,1e12,1e13,1e14,1e15,1e16,1e17,1e18,1e19,1e20,1e21,1e22};
+#define cJSON_MAX_EXACT_MANTISSA 9007199254740992ULL	/* 2^53 */
+
+/* Slow path for numbers the exact kernels can't handle: hand the token to strtod, which rounds correctly. */
+static double parse_number_slow(const char *start,const char *end)
+{
+	char buf[64],*copy=buf;double n;size_t len=end-start;
+	if (len>=sizeof(buf) && !(copy=(char*)cJSON_malloc(len+1))) return 0;
+	memcpy(copy,start,len);copy[len]=0;	/* Copy so strtod can't read past the token (e.g. into "0x..."). */
+	n=strtod(copy,0);
+	if (copy!=buf) cJSON_free(copy);
+	return n;
+}
+
+/* Parse the input text to generate a number, and populate the result into item.
+   Up to 19 significant digits are gathered into an integer mantissa. Integers, and mantissas <= 2^53 with a
+   decimal exponent within +/-22, are converted exactly; anything else is passed to parse_number_slow.
+   Returns 0 if there is no digit where the grammar needs one. */
 static const char *parse_number(cJSON *item,const char *num)
 {
-	double n=0,sign=1,scale=0;int subscale=0,signsubscale=1;
+	const char *start=num;unsigned long long m=0;int nd=0,exp10=0,subscale=0,signsubscale=1,neg=0,trunc=0;double n;
 
-	if (*num=='-') sign=-1,num++;	/* Has sign? */
+	if (*num=='-') neg=1,num++;	/* Has sign? */
+	if (*num<'0' || *num>'9') return 0;	/* A number needs digits: "-" alone is not one. */
 	if (*num=='0') num++;			/* is zero */
-	if (*num>='1' && *num<='9')	do	n=(n*10.0)+(*num++ -'0');	while (*num>='0' && *num<='9');	/* Number? */
-	if (*num=='.' && num[1]>='0' && num[1]<='9') {num++;		do	n=(n*10.0)+(*num++ -'0'),scale--; while (*num>='0' && *num<='9');}	/* Fractional part? */
+	else while (*num>='0' && *num<='9')	/* Number? */
+	{
+		if (nd<19) m=(m*10)+(*num-'0'),nd++; else {exp10++;if (*num!='0') trunc=1;}
+		num++;
+	}
+	if (*num=='.' && num[1]>='0' && num[1]<='9')	/* Fractional part? */
+	{
+		num++;
+		do {
+			if (nd<19) {m=(m*10)+(*num-'0');if (m) nd++;exp10--;} else if (*num!='0') trunc=1;
+			num++;
+		} while (*num>='0' && *num<='9');
+	}
 	if (*num=='e' || *num=='E')		/* Exponent? */
 	{	num++;if (*num=='+') num++;	else if (*num=='-') signsubscale=-1,num++;		/* With sign? */
-		while (*num>='0' && *num<='9') subscale=(subscale*10)+(*num++ - '0');	/* Number? */
+		if (*num<'0' || *num>'9') return 0;	/* Nor is "1e". */
+		while (*num>='0' && *num<='9') {if (subscale<100000) subscale=(subscale*10)+(*num-'0');num++;}	/* Number? */
 	}
+	exp10+=subscale*signsubscale;
+
+	if (!m && !trunc)									n=0;
+	else if (!trunc && !exp10)							n=(double)m;	/* Integer: a single correctly rounded conversion. */
+	else if (!trunc && m<=cJSON_MAX_EXACT_MANTISSA && exp10>=-22 && exp10<=22)
+		n=(exp10<0)?(double)m/cJSON_pow10[-exp10]:(double)m*cJSON_pow10[exp10];
+	else												n=fabs(parse_number_slow(start,num));
+	if (neg) n=-n;
 
-	n=sign*n*pow(10.0,(scale+subscale*signsubscale));	/* number = +/- number.fraction * 10^+/- exponent */
-	
 	item->valuedouble=n;
-	item->valueint=(int)n;
+	item->valueint=(n>=INT_MAX)?INT_MAX:(n<=INT_MIN)?INT_MIN:(int)n;
 	item->type=cJSON_Number;
 	return num;
 }
 
-/* Render the number nicely from the given item into a string. */
-static char *print_number(cJSON *item)
+static const char cJSON_digit_pairs[]=
+	"00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+	"40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+	"8081828384858687888990919293949596979899";
+
+/* Write v in decimal to buf, two digits at a time. Returns the number of chars written. */
+static int print_uint(char *buf,unsigned long long v)
+{
+	char tmp[20],*p=tmp+sizeof(tmp);int len;
+	while (v>=100) {p-=2;memcpy(p,cJSON_digit_pairs+(v%100)*2,2);v/=100;}
+	if (v>=10) {p-=2;memcpy(p,cJSON_digit_pairs+v*2,2);} else *--p=(char)('0'+v);
+	len=(int)(tmp+sizeof(tmp)-p);memcpy(buf,p,len);
+	return len;
+}
+
+/* Render a number into buf, which must hold cJSON_NUMBER_BUF chars. Returns the length, excluding the terminator.
+   Integral values are formatted by hand; anything else gets the shortest %g form that parses back to the same double. */
+#define cJSON_NUMBER_BUF 32
+static int print_number_to(char *buf,double d)
 {
-	char *str;
-	double d=item->valuedouble;
-	if (fabs(((double)item->valueint)-d)<=DBL_EPSILON && d<=INT_MAX && d>=INT_MIN)
+	int len,prec;
+	if (d!=d || d-d!=0)	{memcpy(buf,"null",5);return 4;}	/* NaN and infinities have no JSON representation. */
+	if (fabs(d)<1e15 && floor(d)==d)
 	{
-		str=(char*)cJSON_malloc(21);	/* 2^64+1 can be represented in 21 chars. */
-		if (str) sprintf(str,"%d",item->valueint);
+		len=0;if (d<0) buf[len++]='-';
+		len+=print_uint(buf+len,(unsigned long long)fabs(d));
+		buf[len]=0;return len;
 	}
-	else
+	for (prec=15;prec<17;prec++)
 	{
-		str=(char*)cJSON_malloc(64);	/* This is a nice tradeoff. */
-		if (str)
-		{
-			if (fabs(floor(d)-d)<=DBL_EPSILON && fabs(d)<1.0e60)sprintf(str,"%.0f",d);
-			else if (fabs(d)<1.0e-6 || fabs(d)>1.0e9)			sprintf(str,"%e",d);
-			else												sprintf(str,"%f",d);
-		}
+		len=sprintf(buf,"%.*g",prec,d);
+		if (strtod(buf,0)==d) return len;
 	}
-	return str;
+	return sprintf(buf,"%.17g",d);
+}
+
+/* Output buffer for the printer. The whole tree is rendered into one buffer, which grows as needed unless it was
+   supplied by the caller (noalloc). With write_fn set, the buffer is handed to the callback whenever it fills up. */
+typedef struct {
+	char *buffer;size_t length,offset;int noalloc,borrowed;	/* borrowed: buffer belongs to the caller, don't free it when growing. */
+	size_t (*write_fn)(const char *data,size_t len,void *userdata);void *userdata;
+} printbuffer;
+
+/* Return a pointer to at least "needed" free bytes at the end of p, flushing or growing the buffer if necessary. */
+static char *ensure(printbuffer *p,size_t needed)
+{
+	char *newbuffer;size_t newsize;
+	if (!p->buffer) return 0;
+	if (p->offset+needed<=p->length) return p->buffer+p->offset;
+	if (p->write_fn && p->offset)
+	{
+		if (p->write_fn(p->buffer,p->offset,p->userdata)!=p->offset) return 0;
+		p->offset=0;
+		if (needed<=p->length) return p->buffer;
+	}
+	if (p->noalloc) return 0;
+	newsize=p->length?p->length:64;
+	while (newsize<p->offset+needed) newsize*=2;
+	if (!(newbuffer=(char*)cJSON_malloc(newsize))) return 0;
+	memcpy(newbuffer,p->buffer,p->offset);
+	if (!p->borrowed) cJSON_free(p->buffer);
+	p->buffer=newbuffer;p->length=newsize;p->borrowed=0;
+	return p->buffer+p->offset;
+}
+
+/* Append len bytes of str to p. */
+static int print_raw(printbuffer *p,const char *str,size_t len)
+{
+	char *out=ensure(p,len);
+	if (!out) return 0;
+	memcpy(out,str,len);p->offset+=len;
+	return 1;
+}
+
+/* Append n copies of c to p. */
+static int print_repeat(printbuffer *p,char c,int n)
+{
+	char *out;
+	if (n<=0) return 1;
+	if (!(out=ensure(p,n))) return 0;
+	memset(out,c,n);p->offset+=n;
+	return 1;
+}
+
+/* Render the number nicely from the given item straight into the buffer. */
+static int print_number(cJSON *item,printbuffer *p)
+{
+	char buf[cJSON_NUMBER_BUF];
+	return print_raw(p,buf,print_number_to(buf,item->valuedouble));	/* Via a local buffer so preallocated output can be sized exactly. */
+}
+
+/* Scanning kernels. The parser and minifier spend most of their time looking for the next interesting byte, so on x86
+   we test 16 (SSE2) or 32 (AVX2, chosen at runtime) bytes at a time, with plain loops everywhere else. The vector loads
+   are aligned, so while they may read past the terminating null they never touch a page the string doesn't.
+   scan_nonws:   first byte that is not whitespace/control (>32) or is the null.
+   scan_string:  first quote, backslash or null.
+   scan_minify:  first byte cJSON_Minify has to look at: whitespace, '/', quote or null. */
+static const char *scan_nonws_scalar(const char *s)		{while (*s && (unsigned char)*s<=32) s++; return s;}
+static const char *scan_string_scalar(const char *s)	{while (*s && *s!='\"' && *s!='\\') s++; return s;}
+static const char *scan_minify_scalar(const char *s)	{while (*s && !strchr(" \t\r\n/\"",*s)) s++; return s;}
+
+/* AddressSanitizer can't tell these reads are safe, so sanitized builds use the plain loops. */
+#if defined(__GNUC__) && defined(__SSE2__) && (defined(__x86_64__) || defined(__i386__)) && !defined(__SANITIZE_ADDRESS__)
+#define cJSON_SIMD_X86
+#include <immintrin.h>
+
+#define SCAN_KERNEL(name,width,vec,load,movemask,MASK) \
+	static const char *name(const char *s) \
+	{ \
+		const vec *p=(const vec*)((uintptr_t)s&~(uintptr_t)(width-1));unsigned m; \
+		m=(unsigned)movemask(MASK(load(p)))>>((uintptr_t)s&(width-1));	/* Drop the bytes before s. */ \
+		if (m) return s+__builtin_ctz(m); \
+		for (;;) {p++;if ((m=(unsigned)movemask(MASK(load(p))))) return (const char*)p+__builtin_ctz(m);} \
+	}
+
+#define SSE2_EQ(v,c)		_mm_cmpeq_epi8(v,_mm_set1_epi8(c))
+#define SSE2_NONWS(v)		_mm_or_si128(SSE2_EQ(v,0),_mm_xor_si128(_mm_cmpeq_epi8(_mm_min_epu8(v,_mm_set1_epi8(32)),v),_mm_set1_epi8(-1)))
+#define SSE2_STRING(v)		_mm_or_si128(_mm_or_si128(SSE2_EQ(v,'\"'),SSE2_EQ(v,'\\')),SSE2_EQ(v,0))
+#define SSE2_MINIFY(v)		_mm_or_si128(_mm_or_si128(_mm_or_si128(SSE2_EQ(v,' '),SSE2_EQ(v,'\t')),_mm_or_si128(SSE2_EQ(v,'\r'),SSE2_EQ(v,'\n'))), \
+							_mm_or_si128(_mm_or_si128(SSE2_EQ(v,'/'),SSE2_EQ(v,'\"')),SSE2_EQ(v,0)))
+SCAN_KERNEL(scan_nonws_sse2,16,__m128i,_mm_load_si128,_mm_movemask_epi8,SSE2_NONWS)
+SCAN_KERNEL(scan_string_sse2,16,__m128i,_mm_load_si128,_mm_movemask_epi8,SSE2_STRING)
+SCAN_KERNEL(scan_minify_sse2,16,__m128i,_mm_load_si128,_mm_movemask_epi8,SSE2_MINIFY)
+
+#define AVX2_EQ(v,c)		_mm256_cmpeq_epi8(v,_mm256_set1_epi8(c))
+#define AVX2_NONWS(v)		_mm256_or_si256(AVX2_EQ(v,0),_mm256_xor_si256(_mm256_cmpeq_epi8(_mm256_min_epu8(v,_mm256_set1_epi8(32)),v),_mm256_set1_epi8(-1)))
+#define AVX2_STRING(v)		_mm256_or_si256(_mm256_or_si256(AVX2_EQ(v,'\"'),AVX2_EQ(v,'\\')),AVX2_EQ(v,0))
+#define AVX2_MINIFY(v)		_mm256_or_si256(_mm256_or_si256(_mm256_or_si256(AVX2_EQ(v,' '),AVX2_EQ(v,'\t')),_mm256_or_si256(AVX2_EQ(v,'\r'),AVX2_EQ(v,'\n'))), \
+							_mm256_or_si256(_mm256_or_si256(AVX2_EQ(v,'/'),AVX2_EQ(v,'\"')),AVX2_EQ(v,0)))
+__attribute__((target("avx2"))) SCAN_KERNEL(scan_nonws_avx2,32,__m256i,_mm256_load_si256,_mm256_movemask_epi8,AVX2_NONWS)
+__attribute__((target("avx2"))) SCAN_KERNEL(scan_string_avx2,32,__m256i,_mm256_load_si256,_mm256_movemask_epi8,AVX2_STRING)
+__attribute__((target("avx2"))) SCAN_KERNEL(scan_minify_avx2,32,__m256i,_mm256_load_si256,_mm256_movemask_epi8,AVX2_MINIFY)
+#endif
+
+typedef struct {const char *(*nonws)(const char *s);const char *(*string)(const char *s);const char *(*minify)(const char *s);} scan_kernels;
+#ifdef cJSON_SIMD_X86
+static const scan_kernels kernels_avx2={scan_nonws_avx2,scan_string_avx2,scan_minify_avx2};
+static const scan_kernels kernels_sse2={scan_nonws_sse2,scan_string_sse2,scan_minify_sse2};
+#endif
+static const scan_kernels kernels_scalar={scan_nonws_scalar,scan_string_scalar,scan_minify_scalar};
+
+/* The chosen set is published through one pointer, so a thread can never see a mix of old and new kernels. */
+static const scan_kernels *kernels=0;
+#ifdef __GNUC__
+#define KERNELS_GET()		__atomic_load_n(&kernels,__ATOMIC_RELAXED)
+#define KERNELS_SET(k)		__atomic_store_n(&kernels,(k),__ATOMIC_RELAXED)
+#else
+#define KERNELS_GET()		(kernels)
+#define KERNELS_SET(k)		(kernels=(k))
+#endif
+#define scan_nonws(s)		(KERNELS_GET()->nonws(s))
+#define scan_string(s)		(KERNELS_GET()->string(s))
+#define scan_minify(s)		(KERNELS_GET()->minify(s))
+
+/* Pick the widest kernels this CPU supports. Racing callers all store the same pointer. */
+static void cJSON_InitKernels(void)
+{
+	if (KERNELS_GET()) return;
+#ifdef cJSON_SIMD_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))	{KERNELS_SET(&kernels_avx2);return;}
+	KERNELS_SET(&kernels_sse2);
+	(void)kernels_scalar;
+#else
+	KERNELS_SET(&kernels_scalar);
+#endif
 }
 
 static unsigned parse_hex4(const char *str)
@@ -152,74 +413,90 @@ static unsigned parse_hex4(const char *str)
 
 /* Parse the input text into an unescaped cstring, and populate item. */
 static const unsigned char firstByteMark[7] = { 0x00, 0x00, 0xC0, 0xE0, 0xF0, 0xF8, 0xFC };
+/* Unescape the string body [ptr,end) into out, which may alias ptr (the output is never longer). Plain runs are
+   copied in bulk; returns the end of the output. */
+static char *parse_string_copy(char *out,const char *ptr,const char *end)
+{
+	const char *run;unsigned uc,uc2;int len;
+	while (ptr<end)
+	{
+		run=scan_string(ptr);	/* Stops at a backslash, or at end (a quote or null). */
+		memmove(out,ptr,run-ptr);out+=run-ptr;ptr=run;
+		if (ptr>=end) break;
+		ptr++;
+		switch (*ptr)
+		{
+			case 'b': *out++='\b';	break;
+			case 'f': *out++='\f';	break;
+			case 'n': *out++='\n';	break;
+			case 'r': *out++='\r';	break;
+			case 't': *out++='\t';	break;
+			case 'u':	 /* transcode utf16 to utf8. */
+				if (end-ptr<5) {ptr=end;break;}	/* truncated escape. */
+				uc=parse_hex4(ptr+1);ptr+=4;	/* get the unicode char. */
+
+				if ((uc>=0xDC00 && uc<=0xDFFF) || uc==0)	break;	/* check for invalid.	*/
+
+				if (uc>=0xD800 && uc<=0xDBFF)	/* UTF16 surrogate pairs.	*/
+				{
+					if (end-ptr<7 || ptr[1]!='\\' || ptr[2]!='u')	break;	/* missing second-half of surrogate.	*/
+					uc2=parse_hex4(ptr+3);ptr+=6;
+					if (uc2<0xDC00 || uc2>0xDFFF)		break;	/* invalid second-half of surrogate.	*/
+					uc=0x10000 + (((uc&0x3FF)<<10) | (uc2&0x3FF));
+				}
+
+				len=4;if (uc<0x80) len=1;else if (uc<0x800) len=2;else if (uc<0x10000) len=3; out+=len;
+				
+				switch (len) {
+					case 4: *--out =((uc | 0x80) & 0xBF); uc >>= 6;
+					/* fall through */
+					case 3: *--out =((uc | 0x80) & 0xBF); uc >>= 6;
+					/* fall through */
+					case 2: *--out =((uc | 0x80) & 0xBF); uc >>= 6;
+					/* fall through */
+					case 1: *--out =(uc | firstByteMark[len]);
+				}
+				out+=len;
+				break;
+			default:  *out++=*ptr; break;
+		}
+		ptr++;
+	}
+	return out;
+}
+
+/* Parse the input text into an unescaped cstring, and populate item. One scan finds the closing quote, which bounds
+   the output size; a second copies the body across. */
 static const char *parse_string(cJSON *item,const char *str)
 {
-	const char *ptr=str+1;char *ptr2;char *out;int len=0;unsigned uc,uc2;
+	const char *end=str+1;char *out;
 	if (*str!='\"') {ep=str;return 0;}	/* not a string! */
 	
-	while (*ptr!='\"' && *ptr && ++len) if (*ptr++ == '\\') ptr++;	/* Skip escaped quotes. */
-	
-	out=(char*)cJSON_malloc(len+1);	/* This is how long we need for the string, roughly. */
-	if (!out) return 0;
-	
-	ptr=str+1;ptr2=out;
-	while (*ptr!='\"' && *ptr)
+	for (;;)	/* Skip escaped quotes. */
 	{
-		if (*ptr!='\\') *ptr2++=*ptr++;
-		else
-		{
-			ptr++;
-			switch (*ptr)
-			{
-				case 'b': *ptr2++='\b';	break;
-				case 'f': *ptr2++='\f';	break;
-				case 'n': *ptr2++='\n';	break;
-				case 'r': *ptr2++='\r';	break;
-				case 't': *ptr2++='\t';	break;
-				case 'u':	 /* transcode utf16 to utf8. */
-					uc=parse_hex4(ptr+1);ptr+=4;	/* get the unicode char. */
-
-					if ((uc>=0xDC00 && uc<=0xDFFF) || uc==0)	break;	/* check for invalid.	*/
-
-					if (uc>=0xD800 && uc<=0xDBFF)	/* UTF16 surrogate pairs.	*/
-					{
-						if (ptr[1]!='\\' || ptr[2]!='u')	break;	/* missing second-half of surrogate.	*/
-						uc2=parse_hex4(ptr+3);ptr+=6;
-						if (uc2<0xDC00 || uc2>0xDFFF)		break;	/* invalid second-half of surrogate.	*/
-						uc=0x10000 + (((uc&0x3FF)<<10) | (uc2&0x3FF));
-					}
-
-					len=4;if (uc<0x80) len=1;else if (uc<0x800) len=2;else if (uc<0x10000) len=3; ptr2+=len;
-					
-					switch (len) {
-						case 4: *--ptr2 =((uc | 0x80) & 0xBF); uc >>= 6;
-						case 3: *--ptr2 =((uc | 0x80) & 0xBF); uc >>= 6;
-						case 2: *--ptr2 =((uc | 0x80) & 0xBF); uc >>= 6;
-						case 1: *--ptr2 =(uc | firstByteMark[len]);
-					}
-					ptr2+=len;
-					break;
-				default:  *ptr2++=*ptr; break;
-			}
-			ptr++;
-		}
+		end=scan_string(end);
+		if (*end!='\\') break;
+		if (!end[1]) {end++;break;}	/* Backslash right before the null. */
+		end+=2;
 	}
-	*ptr2=0;
-	if (*ptr=='\"') ptr++;
+	
+	out=(char*)cJSON_malloc(end-str);	/* Body length plus the terminator. */
+	if (!out) return 0;
+	*parse_string_copy(out,str+1,end)=0;
 	item->valuestring=out;
 	item->type=cJSON_String;
-	return ptr;
+	return (*end=='\"')?end+1:end;
 }
 
 /* Render the cstring provided to an escaped version that can be printed. */
-static char *print_string_ptr(const char *str)
+static int print_string_ptr(const char *str,printbuffer *p)
 {
-	const char *ptr;char *ptr2,*out;int len=0;unsigned char token;
+	const char *ptr;char *ptr2,*out;size_t len=0;unsigned char token;
 	
-	if (!str) return cJSON_strdup("");
+	if (!str) return 1;
 	ptr=str;while ((token=*ptr) && ++len) {if (strchr("\"\\\b\f\n\r\t",token)) len++; else if (token<32) len+=5;ptr++;}
 	
-	out=(char*)cJSON_malloc(len+3);
+	out=ensure(p,len+2);
 	if (!out) return 0;
 
 	ptr2=out;ptr=str;
@@ -239,26 +516,27 @@ static char *print_string_ptr(const char *str)
 				case '\n':	*ptr2++='n';	break;
 				case '\r':	*ptr2++='r';	break;
 				case '\t':	*ptr2++='t';	break;
-				default: sprintf(ptr2,"u%04x",token);ptr2+=5;	break;	/* escape and print */
+				default: *ptr2++='u';*ptr2++='0';*ptr2++='0';*ptr2++="0123456789abcdef"[token>>4];*ptr2++="0123456789abcdef"[token&15];	break;	/* escape and print */
 			}
 		}
 	}
-	*ptr2++='\"';*ptr2++=0;
-	return out;
+	*ptr2++='\"';
+	p->offset+=ptr2-out;
+	return 1;
 }
 /* Invote print_string_ptr (which is useful) on an item. */
-static char *print_string(cJSON *item)	{return print_string_ptr(item->valuestring);}
+static int print_string(cJSON *item,printbuffer *p)	{return print_string_ptr(item->valuestring,p);}
 
 /* Predeclare these prototypes. */
 static const char *parse_value(cJSON *item,const char *value);
-static char *print_value(cJSON *item,int depth,int fmt);
+static int print_value(cJSON *item,int depth,int fmt,printbuffer *p);
 static const char *parse_array(cJSON *item,const char *value);
-static char *print_array(cJSON *item,int depth,int fmt);
+static int print_array(cJSON *item,int depth,int fmt,printbuffer *p);
 static const char *parse_object(cJSON *item,const char *value);
-static char *print_object(cJSON *item,int depth,int fmt);
+static int print_object(cJSON *item,int depth,int fmt,printbuffer *p);
 
-/* Utility to jump whitespace and cr/lf */
-static const char *skip(const char *in) {while (in && *in && (unsigned char)*in<=32) in++; return in;}
+/* Utility to jump whitespace and cr/lf. Most gaps are empty or a single byte, so check that before scanning. */
+static const char *skip(const char *in) {if (!in || (unsigned char)*in>32 || !*in) return in; return scan_nonws(in+1);}
 
 /* Parse an object - create a new root, and populate. */
 cJSON *cJSON_ParseWithOpts(const char *value,const char **return_parse_end,int require_null_terminated)
@@ -267,6 +545,7 @@ cJSON *cJSON_ParseWithOpts(const char *value,const char **return_parse_end,int r
 	cJSON *c=cJSON_New_Item();
 	ep=0;
 	if (!c) return 0;       /* memory fail */
+	cJSON_InitKernels();
 
 	end=parse_value(c,skip(value));
 	if (!end)	{cJSON_Delete(c);return 0;}	/* parse failure. ep is set. */
@@ -280,8 +559,39 @@ cJSON *cJSON_ParseWithOpts(const char *value,const char **return_parse_end,int r
 cJSON *cJSON_Parse(const char *value) {return cJSON_ParseWithOpts(value,0,0);}
 
 /* Render a cJSON item/entity/structure to text. */
-char *cJSON_Print(cJSON *item)				{return print_value(item,0,1);}
-char *cJSON_PrintUnformatted(cJSON *item)	{return print_value(item,0,0);}
+static char *print_alloc(cJSON *item,int prebuffer,int fmt)
+{
+	printbuffer p;
+	memset(&p,0,sizeof(p));
+	p.length=prebuffer>0?prebuffer:256;
+	if (!(p.buffer=(char*)cJSON_malloc(p.length))) return 0;
+	if (!print_value(item,0,fmt,&p) || !print_raw(&p,"",1)) {cJSON_free(p.buffer);return 0;}
+	return p.buffer;
+}
+char *cJSON_Print(cJSON *item)				{return print_alloc(item,0,1);}
+char *cJSON_PrintUnformatted(cJSON *item)	{return print_alloc(item,0,0);}
+char *cJSON_PrintBuffered(cJSON *item,int prebuffer,int fmt)	{return print_alloc(item,prebuffer,fmt);}
+
+int cJSON_PrintPreallocated(cJSON *item,char *buffer,int length,int fmt)
+{
+	printbuffer p;
+	if (!buffer || length<=0) return 0;
+	memset(&p,0,sizeof(p));
+	p.buffer=buffer;p.length=length;p.noalloc=p.borrowed=1;
+	return print_value(item,0,fmt,&p) && print_raw(&p,"",1);
+}
+
+int cJSON_PrintStream(cJSON *item,int fmt,size_t (*write_fn)(const char *data,size_t len,void *userdata),void *userdata)
+{
+	char chunk[4096];printbuffer p;int ok;
+	if (!write_fn) return 0;
+	memset(&p,0,sizeof(p));
+	p.buffer=chunk;p.length=sizeof(chunk);p.borrowed=1;p.write_fn=write_fn;p.userdata=userdata;
+	ok=print_value(item,0,fmt,&p);
+	if (ok && p.offset) ok=(write_fn(p.buffer,p.offset,userdata)==p.offset);
+	if (p.buffer!=chunk) cJSON_free(p.buffer);	/* A string longer than the chunk forced a bigger buffer. */
+	return ok;
+}
 
 /* Parser core - when encountering text, process appropriately. */
 static const char *parse_value(cJSON *item,const char *value)
@@ -299,21 +609,20 @@ static const char *parse_value(cJSON *item,const char *value)
 }
 
 /* Render a value to text. */
-static char *print_value(cJSON *item,int depth,int fmt)
+static int print_value(cJSON *item,int depth,int fmt,printbuffer *p)
 {
-	char *out=0;
 	if (!item) return 0;
 	switch ((item->type)&255)
 	{
-		case cJSON_NULL:	out=cJSON_strdup("null");	break;
-		case cJSON_False:	out=cJSON_strdup("false");break;
-		case cJSON_True:	out=cJSON_strdup("true"); break;
-		case cJSON_Number:	out=print_number(item);break;
-		case cJSON_String:	out=print_string(item);break;
-		case cJSON_Array:	out=print_array(item,depth,fmt);break;
-		case cJSON_Object:	out=print_object(item,depth,fmt);break;
+		case cJSON_NULL:	return print_raw(p,"null",4);
+		case cJSON_False:	return print_raw(p,"false",5);
+		case cJSON_True:	return print_raw(p,"true",4);
+		case cJSON_Number:	return print_number(item,p);
+		case cJSON_String:	return print_string(item,p);
+		case cJSON_Array:	return print_array(item,depth,fmt,p);
+		case cJSON_Object:	return print_object(item,depth,fmt,p);
 	}
-	return out;
+	return 0;
 }
 
 /* Build an array from input text. */
@@ -326,7 +635,7 @@ static const char *parse_array(cJSON *item,const char *value)
 	value=skip(value+1);
 	if (*value==']') return value+1;	/* empty array. */
 
-	item->child=child=cJSON_New_Item();
+	item->child=item->tail=child=cJSON_New_Item();
 	if (!item->child) return 0;		 /* memory fail */
 	value=skip(parse_value(child,skip(value)));	/* skip any spacing, get the value. */
 	if (!value) return 0;
@@ -335,7 +644,7 @@ static const char *parse_array(cJSON *item,const char *value)
 	{
 		cJSON *new_item;
 		if (!(new_item=cJSON_New_Item())) return 0; 	/* memory fail */
-		child->next=new_item;new_item->prev=child;child=new_item;
+		child->next=new_item;new_item->prev=child;item->tail=child=new_item;
 		value=skip(parse_value(child,skip(value+1)));
 		if (!value) return 0;	/* memory fail */
 	}
@@ -345,61 +654,17 @@ static const char *parse_array(cJSON *item,const char *value)
 }
 
 /* Render an array to text */
-static char *print_array(cJSON *item,int depth,int fmt)
+static int print_array(cJSON *item,int depth,int fmt,printbuffer *p)
 {
-	char **entries;
-	char *out=0,*ptr,*ret;int len=5;
 	cJSON *child=item->child;
-	int numentries=0,i=0,fail=0;
-	
-	/* How many entries in the array? */
-	while (child) numentries++,child=child->next;
-	/* Explicitly handle numentries==0 */
-	if (!numentries)
-	{
-		out=(char*)cJSON_malloc(3);
-		if (out) strcpy(out,"[]");
-		return out;
-	}
-	/* Allocate an array to hold the values for each */
-	entries=(char**)cJSON_malloc(numentries*sizeof(char*));
-	if (!entries) return 0;
-	memset(entries,0,numentries*sizeof(char*));
-	/* Retrieve all the results: */
-	child=item->child;
-	while (child && !fail)
+	if (!print_raw(p,"[",1)) return 0;
+	while (child)
 	{
-		ret=print_value(child,depth+1,fmt);
-		entries[i++]=ret;
-		if (ret) len+=strlen(ret)+2+(fmt?1:0); else fail=1;
+		if (!print_value(child,depth+1,fmt,p)) return 0;
+		if (child->next && !print_raw(p,", ",fmt?2:1)) return 0;
 		child=child->next;
 	}
-	
-	/* If we didn't fail, try to malloc the output string */
-	if (!fail) out=(char*)cJSON_malloc(len);
-	/* If that fails, we fail. */
-	if (!out) fail=1;
-
-	/* Handle failure. */
-	if (fail)
-	{
-		for (i=0;i<numentries;i++) if (entries[i]) cJSON_free(entries[i]);
-		cJSON_free(entries);
-		return 0;
-	}
-	
-	/* Compose the output array. */
-	*out='[';
-	ptr=out+1;*ptr=0;
-	for (i=0;i<numentries;i++)
-	{
-		strcpy(ptr,entries[i]);ptr+=strlen(entries[i]);
-		if (i!=numentries-1) {*ptr++=',';if(fmt)*ptr++=' ';*ptr=0;}
-		cJSON_free(entries[i]);
-	}
-	cJSON_free(entries);
-	*ptr++=']';*ptr++=0;
-	return out;	
+	return print_raw(p,"]",1);
 }
 
 /* Build an object from the text. */
@@ -412,7 +677,7 @@ static const char *parse_object(cJSON *item,const char *value)
 	value=skip(value+1);
 	if (*value=='}') return value+1;	/* empty array. */
 	
-	item->child=child=cJSON_New_Item();
+	item->child=item->tail=child=cJSON_New_Item();
 	if (!item->child) return 0;
 	value=skip(parse_string(child,skip(value)));
 	if (!value) return 0;
@@ -425,7 +690,7 @@ static const char *parse_object(cJSON *item,const char *value)
 	{
 		cJSON *new_item;
 		if (!(new_item=cJSON_New_Item()))	return 0; /* memory fail */
-		child->next=new_item;new_item->prev=child;child=new_item;
+		child->next=new_item;new_item->prev=child;item->tail=child=new_item;
 		value=skip(parse_string(child,skip(value+1)));
 		if (!value) return 0;
 		child->string=child->valuestring;child->valuestring=0;
@@ -439,100 +704,99 @@ static const char *parse_object(cJSON *item,const char *value)
 }
 
 /* Render an object to text. */
-static char *print_object(cJSON *item,int depth,int fmt)
+static int print_object(cJSON *item,int depth,int fmt,printbuffer *p)
 {
-	char **entries=0,**names=0;
-	char *out=0,*ptr,*ret,*str;int len=7,i=0,j;
 	cJSON *child=item->child;
-	int numentries=0,fail=0;
-	/* Count the number of entries. */
-	while (child) numentries++,child=child->next;
-	/* Explicitly handle empty object case */
-	if (!numentries)
-	{
-		out=(char*)cJSON_malloc(fmt?depth+4:3);
-		if (!out)	return 0;
-		ptr=out;*ptr++='{';
-		if (fmt) {*ptr++='\n';for (i=0;i<depth-1;i++) *ptr++='\t';}
-		*ptr++='}';*ptr++=0;
-		return out;
-	}
-	/* Allocate space for the names and the objects */
-	entries=(char**)cJSON_malloc(numentries*sizeof(char*));
-	if (!entries) return 0;
-	names=(char**)cJSON_malloc(numentries*sizeof(char*));
-	if (!names) {cJSON_free(entries);return 0;}
-	memset(entries,0,sizeof(char*)*numentries);
-	memset(names,0,sizeof(char*)*numentries);
-
-	/* Collect all the results into our arrays: */
-	child=item->child;depth++;if (fmt) len+=depth;
+	if (!print_raw(p,"{\n",fmt?2:1)) return 0;
+	if (!child) return (!fmt || print_repeat(p,'\t',depth-1)) && print_raw(p,"}",1);	/* Explicitly handle empty object case */
+	depth++;
 	while (child)
 	{
-		names[i]=str=print_string_ptr(child->string);
-		entries[i++]=ret=print_value(child,depth,fmt);
-		if (str && ret) len+=strlen(ret)+strlen(str)+2+(fmt?2+depth:0); else fail=1;
+		if (fmt && !print_repeat(p,'\t',depth)) return 0;
+		if (!print_string_ptr(child->string,p) || !print_raw(p,":\t",fmt?2:1)) return 0;
+		if (!print_value(child,depth,fmt,p)) return 0;
+		if (child->next && !print_raw(p,",",1)) return 0;
+		if (fmt && !print_raw(p,"\n",1)) return 0;
 		child=child->next;
 	}
-	
-	/* Try to allocate the output string */
-	if (!fail) out=(char*)cJSON_malloc(len);
-	if (!out) fail=1;
-
-	/* Handle failure */
-	if (fail)
-	{
-		for (i=0;i<numentries;i++) {if (names[i]) cJSON_free(names[i]);if (entries[i]) cJSON_free(entries[i]);}
-		cJSON_free(names);cJSON_free(entries);
-		return 0;
-	}
-	
-	/* Compose the output: */
-	*out='{';ptr=out+1;if (fmt)*ptr++='\n';*ptr=0;
-	for (i=0;i<numentries;i++)
-	{
-		if (fmt) for (j=0;j<depth;j++) *ptr++='\t';
-		strcpy(ptr,names[i]);ptr+=strlen(names[i]);
-		*ptr++=':';if (fmt) *ptr++='\t';
-		strcpy(ptr,entries[i]);ptr+=strlen(entries[i]);
-		if (i!=numentries-1) *ptr++=',';
-		if (fmt) *ptr++='\n';*ptr=0;
-		cJSON_free(names[i]);cJSON_free(entries[i]);
-	}
-	
-	cJSON_free(names);cJSON_free(entries);
-	if (fmt) for (i=0;i<depth-1;i++) *ptr++='\t';
-	*ptr++='}';*ptr++=0;
-	return out;	
+	if (fmt && !print_repeat(p,'\t',depth-1)) return 0;
+	return print_raw(p,"}",1);
 }
 
 /* Get Array size/item / object item. */
 int    cJSON_GetArraySize(cJSON *array)							{cJSON *c=array->child;int i=0;while(c)i++,c=c->next;return i;}
 cJSON *cJSON_GetArrayItem(cJSON *array,int item)				{cJSON *c=array->child;  while (c && item>0) item--,c=c->next; return c;}
-cJSON *cJSON_GetObjectItem(cJSON *object,const char *string)	{cJSON *c=object->child; while (c && cJSON_strcasecmp(c->string,string)) c=c->next; return c;}
+/* Lookups may race to index the same object, so the index is published with a compare-and-swap: the first one in
+   wins and the others free theirs. Without atomics, objects are only ever scanned. */
+#ifdef __GNUC__
+#define INDEX_LOAD(o)		__atomic_load_n(&(o)->index,__ATOMIC_ACQUIRE)
+#else
+#define INDEX_LOAD(o)		((o)->index)
+#endif
+static void cJSON_IndexPublish(cJSON *object,struct cJSON_Index *idx)
+{
+#ifdef __GNUC__
+	struct cJSON_Index *none=0;
+	if (idx && !__atomic_compare_exchange_n(&object->index,&none,idx,0,__ATOMIC_RELEASE,__ATOMIC_RELAXED)) cJSON_IndexFree(idx);
+#else
+	cJSON_IndexFree(idx);
+#endif
+}
+cJSON *cJSON_GetObjectItem(cJSON *object,const char *string)
+{
+	cJSON *c=object->child;int n=0;struct cJSON_Index *idx=INDEX_LOAD(object);
+	if (idx && string) return idx->slots[cJSON_IndexSlot(idx,string,cJSON_hash(string))].item;
+	while (c && cJSON_strcasecmp(c->string,string)) n++,c=c->next;
+	if (n>=cJSON_INDEX_MIN && !(object->type&cJSON_IsReference)) cJSON_IndexPublish(object,cJSON_IndexBuild(object));	/* Big object: index it for next time. */
+	return c;
+}
 
 /* Utility for array list handling. */
 static void suffix_object(cJSON *prev,cJSON *item) {prev->next=item;item->prev=prev;}
 /* Utility for handling references. */
-static cJSON *create_reference(cJSON *item) {cJSON *ref=cJSON_New_Item();if (!ref) return 0;memcpy(ref,item,sizeof(cJSON));ref->string=0;ref->type|=cJSON_IsReference;ref->next=ref->prev=0;return ref;}
+static cJSON *create_reference(cJSON *item) {cJSON *ref=cJSON_New_Item();if (!ref) return 0;memcpy(ref,item,sizeof(cJSON));ref->string=0;ref->type|=cJSON_IsReference;ref->next=ref->prev=0;ref->index=0;return ref;}
+/* Utilities for keeping tail and index in step when unlinking/replacing a child. */
+static void drop_index(cJSON *parent) {cJSON_IndexFree(parent->index);parent->index=0;}
+static cJSON *detach_item(cJSON *parent,cJSON *c)
+{
+	if (parent->index && !cJSON_IndexRemove(parent->index,c)) drop_index(parent);
+	if (c->prev) c->prev->next=c->next;
+	if (c->next) c->next->prev=c->prev;
+	if (c==parent->child) parent->child=c->next;
+	if (c==parent->tail) parent->tail=c->prev;
+	c->prev=c->next=0;return c;
+}
+static void replace_item(cJSON *parent,cJSON *c,cJSON *newitem)
+{
+	if (parent->index && (!cJSON_IndexRemove(parent->index,c) || cJSON_IndexInsert(parent->index,newitem))) drop_index(parent);	/* Any clash: rebuild lazily. */
+	newitem->next=c->next;newitem->prev=c->prev;if (newitem->next) newitem->next->prev=newitem;
+	if (c==parent->child) parent->child=newitem; else newitem->prev->next=newitem;
+	if (c==parent->tail) parent->tail=newitem;
+	c->next=c->prev=0;cJSON_Delete(c);
+}
 
 /* Add item to array/object. */
-void   cJSON_AddItemToArray(cJSON *array, cJSON *item)						{cJSON *c=array->child;if (!item) return; if (!c) {array->child=item;} else {while (c && c->next) c=c->next; suffix_object(c,item);}}
+void   cJSON_AddItemToArray(cJSON *array, cJSON *item)
+{
+	cJSON *c=array->tail;
+	if (!item) return;
+	if (!c || c->next) {c=array->child;while (c && c->next) c=c->next;}	/* No usable tail (e.g. child set by hand): walk. */
+	if (!c) array->child=item; else suffix_object(c,item);
+	array->tail=item;
+	if (array->index && cJSON_IndexInsert(array->index,item)<0) drop_index(array);
+}
 void   cJSON_AddItemToObject(cJSON *object,const char *string,cJSON *item)	{if (!item) return; if (item->string) cJSON_free(item->string);item->string=cJSON_strdup(string);cJSON_AddItemToArray(object,item);}
 void	cJSON_AddItemReferenceToArray(cJSON *array, cJSON *item)						{cJSON_AddItemToArray(array,create_reference(item));}
 void	cJSON_AddItemReferenceToObject(cJSON *object,const char *string,cJSON *item)	{cJSON_AddItemToObject(object,string,create_reference(item));}
 
-cJSON *cJSON_DetachItemFromArray(cJSON *array,int which)			{cJSON *c=array->child;while (c && which>0) c=c->next,which--;if (!c) return 0;
-	if (c->prev) c->prev->next=c->next;if (c->next) c->next->prev=c->prev;if (c==array->child) array->child=c->next;c->prev=c->next=0;return c;}
+cJSON *cJSON_DetachItemFromArray(cJSON *array,int which)			{cJSON *c=array->child;while (c && which>0) c=c->next,which--;if (!c) return 0;return detach_item(array,c);}
 void   cJSON_DeleteItemFromArray(cJSON *array,int which)			{cJSON_Delete(cJSON_DetachItemFromArray(array,which));}
-cJSON *cJSON_DetachItemFromObject(cJSON *object,const char *string) {int i=0;cJSON *c=object->child;while (c && cJSON_strcasecmp(c->string,string)) i++,c=c->next;if (c) return cJSON_DetachItemFromArray(object,i);return 0;}
+cJSON *cJSON_DetachItemFromObject(cJSON *object,const char *string) {cJSON *c=cJSON_GetObjectItem(object,string);if (c) return detach_item(object,c);return 0;}
 void   cJSON_DeleteItemFromObject(cJSON *object,const char *string) {cJSON_Delete(cJSON_DetachItemFromObject(object,string));}
 
 /* Replace array/object items with new ones. */
-void   cJSON_ReplaceItemInArray(cJSON *array,int which,cJSON *newitem)		{cJSON *c=array->child;while (c && which>0) c=c->next,which--;if (!c) return;
-	newitem->next=c->next;newitem->prev=c->prev;if (newitem->next) newitem->next->prev=newitem;
-	if (c==array->child) array->child=newitem; else newitem->prev->next=newitem;c->next=c->prev=0;cJSON_Delete(c);}
-void   cJSON_ReplaceItemInObject(cJSON *object,const char *string,cJSON *newitem){int i=0;cJSON *c=object->child;while(c && cJSON_strcasecmp(c->string,string))i++,c=c->next;if(c){newitem->string=cJSON_strdup(string);cJSON_ReplaceItemInArray(object,i,newitem);}}
+void   cJSON_ReplaceItemInArray(cJSON *array,int which,cJSON *newitem)		{cJSON *c=array->child;while (c && which>0) c=c->next,which--;if (!c) return;replace_item(array,c,newitem);}
+void   cJSON_ReplaceItemInObject(cJSON *object,const char *string,cJSON *newitem){cJSON *c=cJSON_GetObjectItem(object,string);if(c){newitem->string=cJSON_strdup(string);replace_item(object,c,newitem);}}
 
 /* Create basic types: */
 cJSON *cJSON_CreateNull(void)					{cJSON *item=cJSON_New_Item();if(item)item->type=cJSON_NULL;return item;}
@@ -545,10 +809,10 @@ cJSON *cJSON_CreateArray(void)					{cJSON *item=cJSON_New_Item();if(item)item->t
 cJSON *cJSON_CreateObject(void)					{cJSON *item=cJSON_New_Item();if(item)item->type=cJSON_Object;return item;}
 
 /* Create Arrays: */
-cJSON *cJSON_CreateIntArray(const int *numbers,int count)		{int i;cJSON *n=0,*p=0,*a=cJSON_CreateArray();for(i=0;a && i<count;i++){n=cJSON_CreateNumber(numbers[i]);if(!i)a->child=n;else suffix_object(p,n);p=n;}return a;}
-cJSON *cJSON_CreateFloatArray(const float *numbers,int count)	{int i;cJSON *n=0,*p=0,*a=cJSON_CreateArray();for(i=0;a && i<count;i++){n=cJSON_CreateNumber(numbers[i]);if(!i)a->child=n;else suffix_object(p,n);p=n;}return a;}
-cJSON *cJSON_CreateDoubleArray(const double *numbers,int count)	{int i;cJSON *n=0,*p=0,*a=cJSON_CreateArray();for(i=0;a && i<count;i++){n=cJSON_CreateNumber(numbers[i]);if(!i)a->child=n;else suffix_object(p,n);p=n;}return a;}
-cJSON *cJSON_CreateStringArray(const char **strings,int count)	{int i;cJSON *n=0,*p=0,*a=cJSON_CreateArray();for(i=0;a && i<count;i++){n=cJSON_CreateString(strings[i]);if(!i)a->child=n;else suffix_object(p,n);p=n;}return a;}
+cJSON *cJSON_CreateIntArray(const int *numbers,int count)		{int i;cJSON *n=0,*p=0,*a=cJSON_CreateArray();for(i=0;a && i<count;i++){n=cJSON_CreateNumber(numbers[i]);if(!i)a->child=n;else suffix_object(p,n);p=n;}if(a)a->tail=p;return a;}
+cJSON *cJSON_CreateFloatArray(const float *numbers,int count)	{int i;cJSON *n=0,*p=0,*a=cJSON_CreateArray();for(i=0;a && i<count;i++){n=cJSON_CreateNumber(numbers[i]);if(!i)a->child=n;else suffix_object(p,n);p=n;}if(a)a->tail=p;return a;}
+cJSON *cJSON_CreateDoubleArray(const double *numbers,int count)	{int i;cJSON *n=0,*p=0,*a=cJSON_CreateArray();for(i=0;a && i<count;i++){n=cJSON_CreateNumber(numbers[i]);if(!i)a->child=n;else suffix_object(p,n);p=n;}if(a)a->tail=p;return a;}
+cJSON *cJSON_CreateStringArray(const char **strings,int count)	{int i;cJSON *n=0,*p=0,*a=cJSON_CreateArray();for(i=0;a && i<count;i++){n=cJSON_CreateString(strings[i]);if(!i)a->child=n;else suffix_object(p,n);p=n;}if(a)a->tail=p;return a;}
 
 /* Duplication */
 cJSON *cJSON_Duplicate(cJSON *item,int recurse)
@@ -575,12 +839,179 @@ cJSON *cJSON_Duplicate(cJSON *item,int recurse)
 		else		{newitem->child=newchild;nptr=newchild;}					/* Set newitem->child and move to it */
 		cptr=cptr->next;
 	}
+	newitem->tail=nptr;
 	return newitem;
 }
 
+/* Incremental parser. A small state machine that is fed arbitrary chunks and reports each value through the handler
+   as soon as it is complete. Strings and numbers are gathered in a fixed token buffer and decoded with the same
+   kernels as parse_string/parse_number; nothing else is buffered, so memory use is bounded by max_token. */
+#define cJSON_SAX_MAX_DEPTH 128
+enum {sax_value,sax_value_or_end,sax_key,sax_key_or_end,sax_colon,sax_comma_or_end,sax_string,sax_keystring,sax_number,sax_literal};
+struct cJSON_SAX {
+	int (*handler)(const cJSON_SAXEvent *event,void *userdata);void *userdata;
+	int state,escape,failed,depth,documents;
+	unsigned char stack[cJSON_SAX_MAX_DEPTH];	/* cJSON_Array or cJSON_Object for each open container. */
+	char *token,*key;size_t toklen,keylen,maxtoken;
+	const char *literal;int littype;size_t litpos;
+};
+
+cJSON_SAX *cJSON_SAXNew(size_t max_token,int (*handler)(const cJSON_SAXEvent *event,void *userdata),void *userdata)
+{
+	cJSON_SAX *sax;
+	if (!handler || !max_token) return 0;
+	if (!(sax=(cJSON_SAX*)cJSON_malloc(sizeof(cJSON_SAX)))) return 0;
+	memset(sax,0,sizeof(cJSON_SAX));
+	sax->token=(char*)cJSON_malloc(max_token+1);sax->key=(char*)cJSON_malloc(max_token+1);
+	if (!sax->token || !sax->key) {cJSON_SAXDelete(sax);return 0;}
+	sax->handler=handler;sax->userdata=userdata;sax->maxtoken=max_token;sax->state=sax_value;
+	cJSON_InitKernels();
+	return sax;
+}
+
+void cJSON_SAXDelete(cJSON_SAX *sax) {if (sax) {cJSON_free(sax->token);cJSON_free(sax->key);cJSON_free(sax);}}
+
+/* Report an event for the value just completed, or the container just opened/closed, and work out what comes next. */
+static int sax_emit(cJSON_SAX *sax,int event,int type,cJSON *item)
+{
+	cJSON_SAXEvent ev;int member=sax->depth && sax->stack[sax->depth-1]==cJSON_Object;
+	memset(&ev,0,sizeof(ev));
+	ev.event=event;ev.type=type;ev.depth=sax->depth;
+	if (event==cJSON_SAX_End)	{ev.depth=--sax->depth;member=sax->depth && sax->stack[sax->depth-1]==cJSON_Object;}
+	else if (member)			ev.key=sax->key;
+	if (item) {ev.valuestring=item->valuestring;ev.valuelength=sax->toklen;ev.valueint=item->valueint;ev.valuedouble=item->valuedouble;}
+	if (!sax->handler(&ev,sax->userdata)) return 0;
+	if (event==cJSON_SAX_Start)
+	{
+		if (sax->depth==cJSON_SAX_MAX_DEPTH) return 0;
+		sax->stack[sax->depth++]=(unsigned char)type;
+		sax->state=(type==cJSON_Array)?sax_value_or_end:sax_key_or_end;
+	}
+	else if (sax->depth)	sax->state=sax_comma_or_end;
+	else					{sax->state=sax_value;sax->documents++;}	/* Top-level value done; another may follow (NDJSON). */
+	return 1;
+}
+
+/* The token buffer holds a complete string body or number: decode it and report it. */
+static int sax_token(cJSON_SAX *sax)
+{
+	cJSON item;const char *end;
+	memset(&item,0,sizeof(item));
+	sax->token[sax->toklen]=0;
+	if (sax->state==sax_number)
+	{
+		end=parse_number(&item,sax->token);
+		if (end!=sax->token+sax->toklen) return 0;
+		return sax_emit(sax,cJSON_SAX_Value,cJSON_Number,&item);
+	}
+	sax->toklen=parse_string_copy(sax->token,sax->token,sax->token+sax->toklen)-sax->token;sax->token[sax->toklen]=0;
+	if (sax->state==sax_keystring)
+	{
+		memcpy(sax->key,sax->token,sax->toklen+1);sax->keylen=sax->toklen;
+		sax->state=sax_colon;return 1;
+	}
+	item.valuestring=sax->token;
+	return sax_emit(sax,cJSON_SAX_Value,cJSON_String,&item);
+}
+
+/* Start a value whose first byte is c. */
+static int sax_begin_value(cJSON_SAX *sax,char c)
+{
+	sax->toklen=0;sax->escape=0;
+	switch (c)
+	{
+		case '{':	return sax_emit(sax,cJSON_SAX_Start,cJSON_Object,0);
+		case '[':	return sax_emit(sax,cJSON_SAX_Start,cJSON_Array,0);
+		case '\"':	sax->state=sax_string;return 1;
+		case 't':	sax->literal="true";sax->littype=cJSON_True;break;
+		case 'f':	sax->literal="false";sax->littype=cJSON_False;break;
+		case 'n':	sax->literal="null";sax->littype=cJSON_NULL;break;
+		default:
+			if (c!='-' && (c<'0' || c>'9')) return 0;
+			sax->token[sax->toklen++]=c;sax->state=sax_number;return 1;
+	}
+	sax->litpos=1;sax->state=sax_literal;return 1;
+}
+
+int cJSON_SAXFeed(cJSON_SAX *sax,const char *data,size_t len)
+{
+	const char *end=data+len;char c;
+	if (!sax || sax->failed) return 0;
+	while (data<end)
+	{
+		c=*data;
+		switch (sax->state)
+		{
+			case sax_string: case sax_keystring:
+				if (!sax->escape && c=='\"')	{data++;if (!sax_token(sax)) goto fail;continue;}
+				if (!c || sax->toklen==sax->maxtoken) goto fail;
+				sax->escape=!sax->escape && c=='\\';
+				sax->token[sax->toklen++]=c;data++;
+				continue;
+			case sax_number:
+				if ((c>='0' && c<='9') || c=='-' || c=='+' || c=='.' || c=='e' || c=='E')
+				{
+					if (sax->toklen==sax->maxtoken) goto fail;
+					sax->token[sax->toklen++]=c;data++;continue;
+				}
+				if (!sax_token(sax)) goto fail;
+				continue;	/* The terminating byte belongs to whatever follows. */
+			case sax_literal:
+				if (c!=sax->literal[sax->litpos++]) goto fail;
+				data++;
+				if (!sax->literal[sax->litpos])
+				{
+					cJSON item;memset(&item,0,sizeof(item));item.valueint=(sax->littype==cJSON_True);
+					if (!sax_emit(sax,cJSON_SAX_Value,sax->littype,&item)) goto fail;
+				}
+				continue;
+		}
+		data++;
+		if ((unsigned char)c<=32 && c) continue;	/* Whitespace between tokens. */
+		switch (sax->state)
+		{
+			case sax_value_or_end:
+				if (c==']') {if (!sax_emit(sax,cJSON_SAX_End,cJSON_Array,0)) goto fail;break;}
+				/* fall through */
+			case sax_value:
+				if (!sax_begin_value(sax,c)) goto fail;
+				break;
+			case sax_key_or_end:
+				if (c=='}') {if (!sax_emit(sax,cJSON_SAX_End,cJSON_Object,0)) goto fail;break;}
+				/* fall through */
+			case sax_key:
+				if (c!='\"') goto fail;
+				sax->toklen=0;sax->escape=0;sax->state=sax_keystring;
+				break;
+			case sax_colon:
+				if (c!=':') goto fail;
+				sax->state=sax_value;
+				break;
+			case sax_comma_or_end:
+				if (c==',') sax->state=(sax->stack[sax->depth-1]==cJSON_Object)?sax_key:sax_value;
+				else if (c==']' && sax->stack[sax->depth-1]==cJSON_Array)	{if (!sax_emit(sax,cJSON_SAX_End,cJSON_Array,0)) goto fail;}
+				else if (c=='}' && sax->stack[sax->depth-1]==cJSON_Object)	{if (!sax_emit(sax,cJSON_SAX_End,cJSON_Object,0)) goto fail;}
+				else goto fail;
+				break;
+		}
+	}
+	return 1;
+fail:
+	sax->failed=1;
+	return 0;
+}
+
+int cJSON_SAXFinish(cJSON_SAX *sax)
+{
+	if (!sax || sax->failed) return 0;
+	if (sax->state==sax_number && (sax->depth || !sax_token(sax))) {sax->failed=1;return 0;}	/* A bare number ends at end of input. */
+	return sax->state==sax_value && !sax->depth && sax->documents;
+}
+
 void cJSON_Minify(char *json)
 {
-	char *into=json;
+	char *into=json,*run;
+	cJSON_InitKernels();
 	while (*json)
 	{
 		if (*json==' ') json++;
@@ -588,9 +1019,20 @@ void cJSON_Minify(char *json)
 		else if (*json=='\r') json++;
 		else if (*json=='\n') json++;
 		else if (*json=='/' && json[1]=='/')  while (*json && *json!='\n') json++;	// double-slash comments, to end of line.
-		else if (*json=='/' && json[1]=='*') {while (*json && !(*json=='*' && json[1]=='/')) json++;json+=2;}	// multiline comments.
-		else if (*json=='\"'){*into++=*json++;while (*json && *json!='\"'){if (*json=='\\') *into++=*json++;*into++=*json++;}*into++=*json++;} // string literals, which are \" sensitive.
-		else *into++=*json++;			// All other characters.
+		else if (*json=='/' && json[1]=='*') {while (*json && !(*json=='*' && json[1]=='/')) json++;if (*json) json+=2;}	// multiline comments.
+		else if (*json=='\"')	// string literals, which are \" sensitive.
+		{
+			*into++=*json++;
+			for (;;)
+			{
+				run=(char*)scan_string(json);memmove(into,json,run-json);into+=run-json;json=run;
+				if (*json!='\\') break;
+				*into++=*json++;if (*json) *into++=*json++;
+			}
+			if (*json) *into++=*json++;
+		}
+		else if ((run=(char*)scan_minify(json+1))!=json+1) {memmove(into,json,run-json);into+=run-json;json=run;}	// Runs of all other characters.
+		else *into++=*json++;
 	}
 	*into=0;	// and null-terminate.
-}
\ No newline at end of file
+}
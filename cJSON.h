@@ -51,6 +51,9 @@ typedef struct cJSON {
 	double valuedouble;			/* The item's number, if type==cJSON_Number */
 
 	char *string;				/* The item's name string, if this item is the child of, or is in the list of subitems of an object. */
+
+	struct cJSON *tail;			/* Last item in the child chain, so appends don't have to walk the list. */
+	struct cJSON_Index *index;	/* Hash of an object's children by name. Built lazily by GetObjectItem for large objects. */
 } cJSON;
 
 typedef struct cJSON_Hooks {
@@ -68,6 +71,12 @@ extern cJSON *cJSON_Parse(const char *value);
 extern char  *cJSON_Print(cJSON *item);
 /* Render a cJSON entity to text for transfer/storage without any formatting. Free the char* when finished. */
 extern char  *cJSON_PrintUnformatted(cJSON *item);
+/* Render a cJSON entity to text using a buffer of prebuffer bytes to start with; a good guess saves regrowing it. fmt=0 gives unformatted, =1 gives formatted. Free the char* when finished. */
+extern char  *cJSON_PrintBuffered(cJSON *item,int prebuffer,int fmt);
+/* Render a cJSON entity into a caller-provided buffer, without allocating. Returns 1 on success, 0 if it didn't fit. */
+extern int    cJSON_PrintPreallocated(cJSON *item,char *buffer,int length,int fmt);
+/* Render a cJSON entity in chunks through write_fn, which returns the number of bytes it consumed (like fwrite). Returns 1 on success, 0 on failure. The text is not null-terminated. */
+extern int    cJSON_PrintStream(cJSON *item,int fmt,size_t (*write_fn)(const char *data,size_t len,void *userdata),void *userdata);
 /* Delete a cJSON entity and all subentities. */
 extern void   cJSON_Delete(cJSON *c);
 
@@ -75,7 +84,8 @@ extern void   cJSON_Delete(cJSON *c);
 extern int	  cJSON_GetArraySize(cJSON *array);
 /* Retrieve item number "item" from array "array". Returns NULL if unsuccessful. */
 extern cJSON *cJSON_GetArrayItem(cJSON *array,int item);
-/* Get item "string" from object. Case insensitive. */
+/* Get item "string" from object. Case insensitive. Large objects are indexed on first lookup, after which this is O(1).
+   Like the other getters, it is safe to call from several threads at once on an object nothing is modifying. */
 extern cJSON *cJSON_GetObjectItem(cJSON *object,const char *string);
 
 /* For analysing failed parses. This returns a pointer to the parse error. You'll probably need to look a few chars back to make sense of it. Defined when cJSON_Parse() returns 0. 0 when cJSON_Parse() succeeds. */
@@ -125,6 +135,34 @@ extern cJSON *cJSON_ParseWithOpts(const char *value,const char **return_parse_en
 
 extern void cJSON_Minify(char *json);
 
+/* Incremental, event-based parsing: feed a document in chunks of any size as it arrives and get a callback for each
+   value as soon as it is complete. Whitespace-separated top-level values (e.g. NDJSON) are parsed one after another.
+   Strings and numbers longer than max_token bytes are treated as a parse error, which bounds memory use. */
+#define cJSON_SAX_Value 0	/* A complete string, number, true, false or null. */
+#define cJSON_SAX_Start 1	/* An array or object was opened. */
+#define cJSON_SAX_End 2		/* An array or object was closed. */
+
+typedef struct cJSON_SAXEvent {
+	int event;					/* cJSON_SAX_Value/Start/End. */
+	int type;					/* cJSON type of the value or container. */
+	int depth;					/* Nesting depth: 0 for a top-level value, 1 for its members, and so on. */
+	const char *key;			/* The member name, if this value (or opened container) is in an object. 0 otherwise. */
+	const char *valuestring;	/* Unescaped string value, if type==cJSON_String. Only valid during the callback. */
+	size_t valuelength;			/* Length of valuestring. */
+	int valueint;				/* The value, if type==cJSON_Number (or 1/0 for cJSON_True/cJSON_False). */
+	double valuedouble;
+} cJSON_SAXEvent;
+
+typedef struct cJSON_SAX cJSON_SAX;
+
+/* Create a parser. The handler returns 0 to abort parsing, nonzero to carry on. Returns 0 on memory failure. */
+extern cJSON_SAX *cJSON_SAXNew(size_t max_token,int (*handler)(const cJSON_SAXEvent *event,void *userdata),void *userdata);
+/* Parse the next len bytes. Returns 0 once the input is malformed or the handler has aborted; further calls keep returning 0. */
+extern int cJSON_SAXFeed(cJSON_SAX *sax,const char *data,size_t len);
+/* Signal end of input. Returns 1 if at least one complete value was parsed and nothing is left half-finished. */
+extern int cJSON_SAXFinish(cJSON_SAX *sax);
+extern void cJSON_SAXDelete(cJSON_SAX *sax);
+
 /* Macros for creating things quickly. */
 #define cJSON_AddNullToObject(object,name)		cJSON_AddItemToObject(object, name, cJSON_CreateNull())
 #define cJSON_AddTrueToObject(object,name)		cJSON_AddItemToObject(object, name, cJSON_CreateTrue())
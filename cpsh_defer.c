@@ -0,0 +1,315 @@
+/*
+  Copyright (c) 2015 Christian Bjartli
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy 
+  of this software and associated documentation files (the "Software"), to deal 
+  in the Software without restriction, including without limitation the rights 
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or 
+  sell copies of the Software, and to permit persons to whom the Software is 
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all 
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE 
+  SOFTWARE.
+*/
+
+#include <string.h>
+#include <stdlib.h>
+#include <limits.h>
+#include "cpsh_defer.h"
+
+#define NO_SLOT UINT_MAX
+#define MIN_SLOTS 1024
+
+/* A scheduled message. The timer comes first, so a timer pointer is also a pointer to its message. */
+struct cpsh_deferred
+{
+    cpsh_timer timer;
+    cpsh_defer_id id;
+    cpsh_message msg;
+    char strings[];
+};
+
+/* Messages taken off the wheel by one pass of the driver */
+typedef struct
+{
+    cpsh_defer *d;
+    cpsh_timer head;
+} cpsh_defer_batch;
+
+/* Private prototypes */
+void *cpsh_defer_driver(void*);
+void cpsh_defer_due(cpsh_timer*, void*);
+int cpsh_defer_slot_alloc(cpsh_defer*);
+void cpsh_defer_slot_release(cpsh_defer*, unsigned);
+
+int
+cpsh_defer_init(cpsh_defer *d, cpsh_defer_fn on_sent, void *userdata)
+{
+    int err;
+
+    memset(d, 0, sizeof(*d));
+    if ((err = cpsh_conn_init(&d->conn)))
+    {
+        return err;
+    }
+
+    d->on_sent = on_sent;
+    d->userdata = userdata;
+    d->free_slot = NO_SLOT;
+    d->ready.next = d->ready.prev = &d->ready;
+    cpsh_wheel_init(&d->wheel, (unsigned long long) time(NULL));
+    pthread_mutex_init(&d->lock, NULL);
+    pthread_cond_init(&d->wake, NULL);
+
+    d->running = 1;
+    if (pthread_create(&d->thread, NULL, &cpsh_defer_driver, d))
+    {
+        pthread_mutex_destroy(&d->lock);
+        pthread_cond_destroy(&d->wake);
+        cpsh_conn_cleanup(&d->conn);
+        return CPSH_ERR_INIT;
+    }
+    return 0;
+}
+
+int
+cpsh_send_at(cpsh_defer *d, cpsh_message *m, time_t when, cpsh_defer_id *id)
+{
+    int err;
+    if ((err = cpsh_validate_input(m)))
+    {
+        return err;
+    }
+
+    struct cpsh_deferred *e = malloc(sizeof(*e) + cpsh_message_strsize(m));
+    if (!e)
+    {
+        return CPSH_ERR_NOMEM;
+    }
+    memset(&e->timer, 0, sizeof(e->timer));
+    cpsh_message_copy(&e->msg, m, e->strings);
+
+    pthread_mutex_lock(&d->lock);
+    if (cpsh_defer_slot_alloc(d))
+    {
+        pthread_mutex_unlock(&d->lock);
+        free(e);
+        return CPSH_ERR_NOMEM;
+    }
+    unsigned slot = d->free_slot;
+    d->free_slot = d->slots[slot].next_free;
+    d->slots[slot].entry = e;
+    e->id = ((cpsh_defer_id) d->slots[slot].gen << 32) | slot;
+    if (id)
+    {
+        *id = e->id;
+    }
+
+    if (when > 0 && (unsigned long long) when > d->wheel.now)
+    {
+        cpsh_wheel_add(&d->wheel, &e->timer, (unsigned long long) when);
+    }
+    else
+    {
+        /* Already due: skip the wheel and wake the driver */
+        e->timer.expires = 0;
+        e->timer.next = &d->ready;
+        e->timer.prev = d->ready.prev;
+        d->ready.prev->next = &e->timer;
+        d->ready.prev = &e->timer;
+        d->nready++;
+        pthread_cond_signal(&d->wake);
+    }
+    pthread_mutex_unlock(&d->lock);
+    return 0;
+}
+
+int
+cpsh_defer_cancel(cpsh_defer *d, cpsh_defer_id id)
+{
+    unsigned slot = (unsigned) (id & 0xffffffffULL);
+    unsigned gen = (unsigned) (id >> 32);
+    struct cpsh_deferred *e = NULL;
+
+    pthread_mutex_lock(&d->lock);
+    if (slot < d->nslots && d->slots[slot].gen == gen && d->slots[slot].entry)
+    {
+        e = d->slots[slot].entry;
+        if (e->timer.expires)
+        {
+            cpsh_wheel_del(&d->wheel, &e->timer);
+        }
+        else
+        {
+            e->timer.prev->next = e->timer.next;
+            e->timer.next->prev = e->timer.prev;
+            d->nready--;
+        }
+        cpsh_defer_slot_release(d, slot);
+    }
+    pthread_mutex_unlock(&d->lock);
+
+    if (!e)
+    {
+        return CPSH_ERR_NOT_FOUND;
+    }
+    free(e);
+    return 0;
+}
+
+size_t
+cpsh_defer_pending(cpsh_defer *d)
+{
+    pthread_mutex_lock(&d->lock);
+    size_t pending = d->wheel.count + d->nready;
+    pthread_mutex_unlock(&d->lock);
+    return pending;
+}
+
+void
+cpsh_defer_cleanup(cpsh_defer *d)
+{
+    unsigned i;
+
+    pthread_mutex_lock(&d->lock);
+    d->running = 0;
+    pthread_cond_signal(&d->wake);
+    pthread_mutex_unlock(&d->lock);
+    pthread_join(d->thread, NULL);
+
+    for (i = 0; i < d->nslots; i++)
+    {
+        free(d->slots[i].entry);
+    }
+    free(d->slots);
+    d->slots = NULL;
+    d->nslots = 0;
+
+    pthread_mutex_destroy(&d->lock);
+    pthread_cond_destroy(&d->wake);
+    cpsh_conn_cleanup(&d->conn);
+}
+
+/*
+ * Makes sure there is a free handle slot, doubling the table if need be. Called with the lock held.
+ */
+int
+cpsh_defer_slot_alloc(cpsh_defer *d)
+{
+    if (d->free_slot != NO_SLOT)
+    {
+        return 0;
+    }
+
+    unsigned n = d->nslots ? d->nslots * 2 : MIN_SLOTS;
+    if (n <= d->nslots || n == NO_SLOT)
+    {
+        return CPSH_ERR_NOMEM;
+    }
+    cpsh_defer_slot *slots = realloc(d->slots, n * sizeof(*slots));
+    if (!slots)
+    {
+        return CPSH_ERR_NOMEM;
+    }
+
+    unsigned i;
+    for (i = d->nslots; i < n; i++)
+    {
+        slots[i].entry = NULL;
+        slots[i].gen = 1;
+        slots[i].next_free = (i + 1 < n) ? i + 1 : NO_SLOT;
+    }
+    d->free_slot = d->nslots;
+    d->slots = slots;
+    d->nslots = n;
+    return 0;
+}
+
+/*
+ * Frees a handle slot. Bumping the generation invalidates any handles still pointing at it.
+ */
+void
+cpsh_defer_slot_release(cpsh_defer *d, unsigned slot)
+{
+    d->slots[slot].entry = NULL;
+    d->slots[slot].gen++;
+    d->slots[slot].next_free = d->free_slot;
+    d->free_slot = slot;
+}
+
+/*
+ * Wheel callback: the message is due, so it can no longer be cancelled. Queue it for sending.
+ */
+void
+cpsh_defer_due(cpsh_timer *t, void *userdata)
+{
+    cpsh_defer_batch *batch = (cpsh_defer_batch *)userdata;
+    struct cpsh_deferred *e = (struct cpsh_deferred *)t;
+
+    cpsh_defer_slot_release(batch->d, (unsigned) (e->id & 0xffffffffULL));
+    t->next = &batch->head;
+    t->prev = batch->head.prev;
+    batch->head.prev->next = t;
+    batch->head.prev = t;
+}
+
+/*
+ * Driver thread. Each second, takes whatever has come due off the wheel and sends it, without holding 
+ * the lock while it talks to the API.
+ */
+void *
+cpsh_defer_driver(void *arg)
+{
+    cpsh_defer *d = (cpsh_defer *)arg;
+    cpsh_defer_batch batch;
+    batch.d = d;
+
+    pthread_mutex_lock(&d->lock);
+    while (d->running)
+    {
+        batch.head.next = batch.head.prev = &batch.head;
+        while (d->ready.next != &d->ready)
+        {
+            cpsh_timer *t = d->ready.next;
+            d->ready.next = t->next;
+            cpsh_defer_due(t, &batch);
+        }
+        d->ready.prev = &d->ready;
+        d->nready = 0;
+        cpsh_wheel_advance(&d->wheel, (unsigned long long) time(NULL), &cpsh_defer_due, &batch);
+
+        if (batch.head.next != &batch.head)
+        {
+            pthread_mutex_unlock(&d->lock);
+            while (batch.head.next != &batch.head)
+            {
+                struct cpsh_deferred *e = (struct cpsh_deferred *) batch.head.next;
+                batch.head.next = e->timer.next;
+                int err = cpsh_conn_send(&d->conn, &e->msg, NULL);
+                if (d->on_sent)
+                {
+                    d->on_sent(e->id, err, d->userdata);
+                }
+                free(e);
+            }
+            pthread_mutex_lock(&d->lock);
+            continue;
+        }
+
+        /* Sleep until the next tick, or until woken for a message that is already due */
+        struct timespec until;
+        until.tv_sec = time(NULL) + 1;
+        until.tv_nsec = 0;
+        pthread_cond_timedwait(&d->wake, &d->lock, &until);
+    }
+    pthread_mutex_unlock(&d->lock);
+    return NULL;
+}
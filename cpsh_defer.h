@@ -0,0 +1,81 @@
+/*
+  Copyright (c) 2015 Christian Bjartli
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy 
+  of this software and associated documentation files (the "Software"), to deal 
+  in the Software without restriction, including without limitation the rights 
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or 
+  sell copies of the Software, and to permit persons to whom the Software is 
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all 
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE 
+  SOFTWARE.
+*/
+
+#ifndef CPSH_DEFER_H
+#define CPSH_DEFER_H
+
+#include <pthread.h>
+#include "cpushover.h"
+#include "cpsh_wheel.h"
+
+/* Deferred delivery. Messages are copied onto a timing wheel with one-second ticks and sent, when their time 
+   comes, by a single driver thread over one persistent connection. Scheduling and cancelling are O(1), and a 
+   pending message costs one allocation: a small header plus a copy of the message and its strings. */
+
+/* Handle for a scheduled message. Stays unique; cancelling a message that was already sent is detected. */
+typedef unsigned long long cpsh_defer_id;
+
+/* Called on the driver thread after each send attempt, with the CPSH_ERR_* result (0 on success). */
+typedef void (*cpsh_defer_fn)(cpsh_defer_id, int, void*);
+
+struct cpsh_deferred;
+
+typedef struct
+{
+    struct cpsh_deferred *entry;
+    unsigned gen;
+    unsigned next_free;
+} cpsh_defer_slot;
+
+typedef struct
+{
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    int running;
+    cpsh_wheel wheel;
+    cpsh_timer ready;           /* Messages scheduled for a time already passed */
+    size_t nready;
+    cpsh_conn conn;
+    cpsh_defer_slot *slots;     /* Maps handles to pending messages */
+    unsigned nslots;
+    unsigned free_slot;
+    cpsh_defer_fn on_sent;
+    void *userdata;
+} cpsh_defer;
+
+/* Start the driver thread. on_sent may be NULL. */
+int cpsh_defer_init(cpsh_defer*, cpsh_defer_fn, void*);
+
+/* Send a copy of the message at (or as soon as possible after) the given time. Times in the past mean now. 
+   The message is validated up front. If id is not NULL, the handle is stored there. */
+int cpsh_send_at(cpsh_defer*, cpsh_message*, time_t, cpsh_defer_id*);
+
+/* Cancel a scheduled message. Returns CPSH_ERR_NOT_FOUND if it has already been sent or cancelled. */
+int cpsh_defer_cancel(cpsh_defer*, cpsh_defer_id);
+
+/* Number of messages waiting to be sent. */
+size_t cpsh_defer_pending(cpsh_defer*);
+
+/* Stop the driver thread and drop any messages still pending, unsent. */
+void cpsh_defer_cleanup(cpsh_defer*);
+#endif
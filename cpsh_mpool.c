@@ -0,0 +1,153 @@
+/*
+  Copyright (c) 2015 Christian Bjartli
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy 
+  of this software and associated documentation files (the "Software"), to deal 
+  in the Software without restriction, including without limitation the rights 
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or 
+  sell copies of the Software, and to permit persons to whom the Software is 
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all 
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE 
+  SOFTWARE.
+*/
+
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include "cpushover.h"
+#include "cpsh_mpool.h"
+
+/* Slots are aligned for any type */
+#define CPSH_MPOOL_ALIGN 16
+
+int
+cpsh_mpool_init(cpsh_mpool *pool, size_t slot_size, size_t budget)
+{
+    size_t i;
+
+    if (slot_size < sizeof(void *))
+    {
+        slot_size = sizeof(void *);
+    }
+    slot_size = (slot_size + CPSH_MPOOL_ALIGN - 1) & ~(size_t)(CPSH_MPOOL_ALIGN - 1);
+
+    pool->slot_size = slot_size;
+    pool->nslots = budget / slot_size;
+    if (pool->nslots == 0)
+    {
+        return CPSH_ERR_INIT;
+    }
+
+    pool->slab = malloc(pool->nslots * slot_size);
+    if (!pool->slab)
+    {
+        return CPSH_ERR_NOMEM;
+    }
+
+    /* Thread the free list front to back, so slots are handed out in address order */
+    pool->free = NULL;
+    for (i = pool->nslots; i-- > 0; )
+    {
+        void **slot = (void **)(pool->slab + i * slot_size);
+        *slot = pool->free;
+        pool->free = slot;
+    }
+
+    pool->in_use = 0;
+    pool->high_water = 0;
+    pool->exhausted = 0;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->freed, NULL);
+    return 0;
+}
+
+void *
+cpsh_mpool_get(cpsh_mpool *pool, int timeout)
+{
+    struct timespec deadline;
+    int waiting = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    if (!pool->free)
+    {
+        pool->exhausted++;
+    }
+
+    while (!pool->free && timeout != 0)
+    {
+        if (timeout < 0)
+        {
+            pthread_cond_wait(&pool->freed, &pool->lock);
+            continue;
+        }
+
+        if (!waiting)
+        {
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += timeout / 1000;
+            deadline.tv_nsec += (long)(timeout % 1000) * 1000000;
+            if (deadline.tv_nsec >= 1000000000)
+            {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000;
+            }
+            waiting = 1;
+        }
+        if (pthread_cond_timedwait(&pool->freed, &pool->lock, &deadline) == ETIMEDOUT)
+        {
+            break;
+        }
+    }
+
+    void **slot = pool->free;
+    if (slot)
+    {
+        pool->free = *slot;
+        if (++pool->in_use > pool->high_water) pool->high_water = pool->in_use;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return slot;
+}
+
+void
+cpsh_mpool_put(cpsh_mpool *pool, void *p)
+{
+    void **slot = (void **)p;
+
+    pthread_mutex_lock(&pool->lock);
+    *slot = pool->free;
+    pool->free = slot;
+    pool->in_use--;
+    pthread_cond_signal(&pool->freed);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void
+cpsh_mpool_get_stats(cpsh_mpool *pool, cpsh_mpool_stats *stats)
+{
+    pthread_mutex_lock(&pool->lock);
+    stats->nslots = pool->nslots;
+    stats->in_use = pool->in_use;
+    stats->high_water = pool->high_water;
+    stats->exhausted = pool->exhausted;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void
+cpsh_mpool_cleanup(cpsh_mpool *pool)
+{
+    free(pool->slab);
+    pool->slab = NULL;
+    pool->free = NULL;
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->freed);
+}
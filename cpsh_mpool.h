@@ -0,0 +1,63 @@
+/*
+  Copyright (c) 2015 Christian Bjartli
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy 
+  of this software and associated documentation files (the "Software"), to deal 
+  in the Software without restriction, including without limitation the rights 
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or 
+  sell copies of the Software, and to permit persons to whom the Software is 
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all 
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE 
+  SOFTWARE.
+*/
+
+#ifndef CPSH_MPOOL_H
+#define CPSH_MPOOL_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+/* Fixed-size slot allocator with a hard memory budget. All slots are carved out of one slab allocated up front, 
+   so memory use is known from the start and doesn't grow, however long the pool stays full. */
+typedef struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t freed;
+    char *slab;
+    void *free;             /* Free slots, linked through their first word */
+    size_t slot_size;
+    size_t nslots;
+    size_t in_use;
+    size_t high_water;      /* Most slots ever in use at once */
+    unsigned long long exhausted;   /* Gets that found no slot free */
+} cpsh_mpool;
+
+/* Pool counters, for seeing how close to its budget a pool runs */
+typedef struct
+{
+    size_t nslots;
+    size_t in_use;
+    size_t high_water;
+    unsigned long long exhausted;
+} cpsh_mpool_stats;
+
+/* Set up a pool of slots of at least slot_size bytes, as many as fit in budget bytes. */
+int cpsh_mpool_init(cpsh_mpool*, size_t, size_t);
+
+/* Take a slot, waiting up to timeout ms for one to be freed if there are none; 0 means don't wait and a 
+   negative timeout waits for as long as it takes. Returns NULL if none became free. */
+void *cpsh_mpool_get(cpsh_mpool*, int);
+
+void cpsh_mpool_put(cpsh_mpool*, void*);
+void cpsh_mpool_get_stats(cpsh_mpool*, cpsh_mpool_stats*);
+void cpsh_mpool_cleanup(cpsh_mpool*);
+#endif
@@ -0,0 +1,613 @@
+/*
+  Copyright (c) 2015 Christian Bjartli
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy 
+  of this software and associated documentation files (the "Software"), to deal 
+  in the Software without restriction, including without limitation the rights 
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or 
+  sell copies of the Software, and to permit persons to whom the Software is 
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all 
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE 
+  SOFTWARE.
+*/
+
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "cpsh_prio.h"
+
+/* A queued message */
+struct cpsh_queued
+{
+    struct cpsh_queued *next;
+    unsigned long long enqueued_ms;
+    cpsh_message msg;
+    char strings[];
+};
+
+/* Handed to each worker thread */
+typedef struct
+{
+    cpsh_prio *p;
+    int reserved;
+    cpsh_conn conn;
+} cpsh_prio_worker_arg;
+
+/* Private prototypes */
+void *cpsh_prio_worker(void*);
+struct cpsh_queued *cpsh_prio_take(cpsh_prio*, int);
+void cpsh_prio_push(cpsh_prio_level*, struct cpsh_queued*);
+void cpsh_prio_wake(cpsh_prio*, int);
+struct cpsh_queued *cpsh_prio_drop(cpsh_prio*, int);
+void cpsh_prio_release(cpsh_prio*, struct cpsh_queued*);
+void cpsh_prio_free(cpsh_prio*, struct cpsh_queued*);
+int cpsh_prio_spill(cpsh_prio*, cpsh_prio_level*, cpsh_message*, unsigned long long);
+int cpsh_prio_spill_line(cpsh_prio*, cpsh_prio_level*, const char*, unsigned long long);
+int cpsh_prio_unspill(cpsh_prio_level*, struct cpsh_queued*);
+unsigned long long cpsh_prio_now_ms(void);
+
+unsigned long long
+cpsh_prio_now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int
+cpsh_prio_init(cpsh_prio *p, unsigned workers, unsigned reserved, cpsh_prio_fn on_sent, void *userdata)
+{
+    static const int weights[] = CPSH_PRIO_WEIGHTS;
+    unsigned i;
+
+    /* At least one worker has to be free to take the weighted levels */
+    if (workers == 0 || workers > CPSH_PRIO_MAX_WORKERS || reserved >= workers)
+    {
+        return CPSH_ERR_INIT;
+    }
+
+    memset(p, 0, sizeof(*p));
+    for (i = 0; i < sizeof(weights) / sizeof(weights[0]); i++)
+    {
+        p->levels[i].weight = weights[i];
+    }
+    for (i = 0; i < CPSH_PRIO_LEVELS; i++)
+    {
+        pthread_mutex_init(&p->levels[i].spill_lock, NULL);
+    }
+    p->reserved = reserved;
+    p->on_sent = on_sent;
+    p->userdata = userdata;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->work, NULL);
+
+    /* Open every connection before starting any worker, so a pool never runs short of workers unnoticed */
+    cpsh_prio_worker_arg *args[CPSH_PRIO_MAX_WORKERS];
+    for (i = 0; i < workers; i++)
+    {
+        args[i] = malloc(sizeof(*args[i]));
+        if (!args[i] || cpsh_conn_init(&args[i]->conn))
+        {
+            free(args[i]);
+            while (i--)
+            {
+                cpsh_conn_cleanup(&args[i]->conn);
+                free(args[i]);
+            }
+            cpsh_prio_cleanup(p);
+            return CPSH_ERR_INIT;
+        }
+        args[i]->p = p;
+        args[i]->reserved = i < reserved;
+    }
+
+    p->running = 1;
+    for (i = 0; i < workers; i++)
+    {
+        if (pthread_create(&p->workers[i], NULL, &cpsh_prio_worker, args[i]))
+        {
+            cpsh_prio_cleanup(p);
+            for (; i < workers; i++)
+            {
+                cpsh_conn_cleanup(&args[i]->conn);
+                free(args[i]);
+            }
+            return CPSH_ERR_INIT;
+        }
+        p->nworkers++;
+    }
+    return 0;
+}
+
+int
+cpsh_prio_set_budget(cpsh_prio *p, size_t budget, int policy, int timeout, const char *spill_dir)
+{
+    if (policy < CPSH_PRIO_BLOCK || policy > CPSH_PRIO_SPILL || (policy == CPSH_PRIO_SPILL && !spill_dir))
+    {
+        return CPSH_ERR_INIT;
+    }
+
+    int err;
+    pthread_mutex_lock(&p->lock);
+    if (p->bounded)
+    {
+        err = CPSH_ERR_INIT;
+    }
+    else if (!(err = cpsh_mpool_init(&p->pool, sizeof(struct cpsh_queued) + CPSH_MESSAGE_STRMAX, budget)))
+    {
+        if (spill_dir && !(p->spill_dir = strdup(spill_dir)))
+        {
+            cpsh_mpool_cleanup(&p->pool);
+            err = CPSH_ERR_NOMEM;
+        }
+        else
+        {
+            p->bounded = 1;
+            p->policy = policy;
+            p->timeout = timeout;
+        }
+    }
+    pthread_mutex_unlock(&p->lock);
+    return err;
+}
+
+int
+cpsh_prio_submit(cpsh_prio *p, cpsh_message *m)
+{
+    int err;
+    if ((err = cpsh_validate_input(m)))
+    {
+        return err;
+    }
+
+    cpsh_prio_level *l = &p->levels[m->priority - CPSH_PRIO_MIN];
+    unsigned long long now = cpsh_prio_now_ms();
+    struct cpsh_queued *q;
+
+    if (!p->bounded)
+    {
+        q = malloc(sizeof(*q) + cpsh_message_strsize(m));
+        if (!q)
+        {
+            return CPSH_ERR_NOMEM;
+        }
+    }
+    else
+    {
+        /* Keep each level in order: once some of it is on disk, the rest follows it there */
+        pthread_mutex_lock(&p->lock);
+        int spilled = l->stats.on_disk != 0;
+        pthread_mutex_unlock(&p->lock);
+        q = spilled ? NULL : cpsh_mpool_get(&p->pool, p->policy == CPSH_PRIO_BLOCK ? p->timeout : 0);
+
+        if (!q && p->policy == CPSH_PRIO_SPILL)
+        {
+            return cpsh_prio_spill(p, l, m, now);
+        }
+        if (!q && p->policy == CPSH_PRIO_DROP)
+        {
+            q = cpsh_prio_drop(p, m->priority);
+        }
+        if (!q)
+        {
+            pthread_mutex_lock(&p->lock);
+            l->stats.submitted++;
+            l->stats.rejected++;
+            pthread_mutex_unlock(&p->lock);
+            return CPSH_ERR_OVERLOAD;
+        }
+    }
+
+    cpsh_message_copy(&q->msg, m, q->strings);
+    q->enqueued_ms = now;
+
+    pthread_mutex_lock(&p->lock);
+    cpsh_prio_push(l, q);
+    l->stats.submitted++;
+
+    cpsh_prio_wake(p, m->priority);
+    pthread_mutex_unlock(&p->lock);
+    return 0;
+}
+
+int
+cpsh_prio_get_pool_stats(cpsh_prio *p, cpsh_mpool_stats *stats)
+{
+    pthread_mutex_lock(&p->lock);
+    int bounded = p->bounded;
+    pthread_mutex_unlock(&p->lock);
+    if (!bounded)
+    {
+        return CPSH_ERR_INIT;
+    }
+    cpsh_mpool_get_stats(&p->pool, stats);
+    return 0;
+}
+
+int
+cpsh_prio_get_stats(cpsh_prio *p, int priority, cpsh_prio_stats *stats)
+{
+    if (priority < CPSH_PRIO_MIN || priority > CPSH_PRIO_MAX)
+    {
+        return CPSH_ERR_MSG_FORMAT;
+    }
+
+    pthread_mutex_lock(&p->lock);
+    *stats = p->levels[priority - CPSH_PRIO_MIN].stats;
+    pthread_mutex_unlock(&p->lock);
+    return 0;
+}
+
+void
+cpsh_prio_cleanup(cpsh_prio *p)
+{
+    unsigned i;
+
+    pthread_mutex_lock(&p->lock);
+    p->running = 0;
+    pthread_cond_broadcast(&p->work);
+    pthread_mutex_unlock(&p->lock);
+    for (i = 0; i < p->nworkers; i++)
+    {
+        pthread_join(p->workers[i], NULL);
+    }
+    p->nworkers = 0;
+
+    for (i = 0; i < CPSH_PRIO_LEVELS; i++)
+    {
+        cpsh_prio_level *l = &p->levels[i];
+        while (l->head)
+        {
+            struct cpsh_queued *q = l->head;
+            l->head = q->next;
+            cpsh_prio_free(p, q);
+        }
+        l->tail = NULL;
+        l->stats.depth = 0;
+
+        if (l->spill)
+        {
+            fclose(l->spill);
+            l->spill = NULL;
+        }
+        l->stats.on_disk = 0;
+        free(l->line);
+        l->line = NULL;
+        pthread_mutex_destroy(&l->spill_lock);
+    }
+
+    if (p->bounded)
+    {
+        cpsh_mpool_cleanup(&p->pool);
+        p->bounded = 0;
+    }
+    free(p->spill_dir);
+    p->spill_dir = NULL;
+
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->work);
+}
+
+/*
+   Picks the next message to send, or NULL if there is nothing this worker may take. Strict levels go 
+   highest first. The others use smooth weighted round robin: every non-empty level earns its weight in 
+   credit, the richest is served and pays back the total, which interleaves levels in proportion to their 
+   weights. Called with the lock held.
+ */
+struct cpsh_queued *
+cpsh_prio_take(cpsh_prio *p, int reserved)
+{
+    cpsh_prio_level *pick = NULL;
+    int i;
+
+    for (i = CPSH_PRIO_LEVELS - 1; i >= CPSH_PRIO_STRICT - CPSH_PRIO_MIN && !pick; i--)
+    {
+        if (p->levels[i].head) pick = &p->levels[i];
+    }
+
+    if (!pick && !reserved)
+    {
+        int total = 0;
+        for (i = 0; i < CPSH_PRIO_STRICT - CPSH_PRIO_MIN; i++)
+        {
+            cpsh_prio_level *l = &p->levels[i];
+            if (!l->head) continue;
+            l->current += l->weight;
+            total += l->weight;
+            if (!pick || l->current > pick->current) pick = l;
+        }
+        if (pick) pick->current -= total;
+    }
+
+    if (!pick)
+    {
+        return NULL;
+    }
+
+    struct cpsh_queued *q = pick->head;
+    pick->head = q->next;
+    if (!pick->head) pick->tail = NULL;
+    pick->stats.depth--;
+
+    unsigned long long waited = cpsh_prio_now_ms() - q->enqueued_ms;
+    pick->stats.wait_total_ms += waited;
+    if (waited > pick->stats.wait_max_ms) pick->stats.wait_max_ms = waited;
+    return q;
+}
+
+/*
+ * Appends q to a level. Called with the lock held.
+ */
+void
+cpsh_prio_push(cpsh_prio_level *l, struct cpsh_queued *q)
+{
+    q->next = NULL;
+    if (l->tail) l->tail->next = q; else l->head = q;
+    l->tail = q;
+    l->stats.depth++;
+}
+
+/*
+ * Takes the oldest message of the lowest priority queued, if that is no higher than priority, to reuse its 
+ * slot. Its sender hears about it through on_sent.
+ */
+struct cpsh_queued *
+cpsh_prio_drop(cpsh_prio *p, int priority)
+{
+    struct cpsh_queued *q = NULL;
+    int i;
+
+    pthread_mutex_lock(&p->lock);
+    for (i = 0; i <= priority - CPSH_PRIO_MIN && !q; i++)
+    {
+        cpsh_prio_level *l = &p->levels[i];
+        if (!l->head) continue;
+
+        q = l->head;
+        l->head = q->next;
+        if (!l->head) l->tail = NULL;
+        l->stats.depth--;
+        l->stats.dropped++;
+    }
+    pthread_mutex_unlock(&p->lock);
+
+    if (q && p->on_sent)
+    {
+        p->on_sent(&q->msg, CPSH_ERR_OVERLOAD, p->userdata);
+    }
+    return q;
+}
+
+/*
+ * Gives back the slot of a sent message. If messages are waiting on disk, the highest-priority one takes it 
+ * over. Called with the lock held, which is let go while the spill file is read.
+ */
+void
+cpsh_prio_release(cpsh_prio *p, struct cpsh_queued *q)
+{
+    for (;;)
+    {
+        cpsh_prio_level *l = NULL;
+        int i;
+
+        for (i = CPSH_PRIO_LEVELS - 1; i >= 0 && !l; i--)
+        {
+            if (p->levels[i].stats.on_disk) l = &p->levels[i];
+        }
+        if (!l)
+        {
+            cpsh_prio_free(p, q);
+            return;
+        }
+
+        /* Claim the oldest line, then read it with only its level locked. That lock is held until the lock 
+           is ours again, so the lines of a level are queued in the order they were read. */
+        l->stats.on_disk--;
+        pthread_mutex_unlock(&p->lock);
+        pthread_mutex_lock(&l->spill_lock);
+        int err = cpsh_prio_unspill(l, q);
+        pthread_mutex_lock(&p->lock);
+        pthread_mutex_unlock(&l->spill_lock);
+
+        if (!err)
+        {
+            cpsh_prio_push(l, q);
+            cpsh_prio_wake(p, q->msg.priority);
+            return;
+        }
+        l->stats.dropped++;
+    }
+}
+
+/* Wake a worker for a message just queued at priority. Any worker can take a high priority one, but a signal for 
+   a lower one may land on a reserved worker, which would go back to sleep and leave it queued, so wake them all. */
+void
+cpsh_prio_wake(cpsh_prio *p, int priority)
+{
+    if (priority < CPSH_PRIO_STRICT && p->reserved)
+    {
+        pthread_cond_broadcast(&p->work);
+    }
+    else
+    {
+        pthread_cond_signal(&p->work);
+    }
+}
+
+void
+cpsh_prio_free(cpsh_prio *p, struct cpsh_queued *q)
+{
+    if (p->bounded)
+    {
+        cpsh_mpool_put(&p->pool, q);
+    }
+    else
+    {
+        free(q);
+    }
+}
+
+/*
+ * Spills a message that doesn't fit in memory to disk, and counts it as submitted
+ */
+int
+cpsh_prio_spill(cpsh_prio *p, cpsh_prio_level *l, cpsh_message *m, unsigned long long enqueued_ms)
+{
+    char *json = cpsh_message_to_json(m);
+    int err = CPSH_ERR_NOMEM;
+    if (json)
+    {
+        pthread_mutex_lock(&l->spill_lock);
+        err = cpsh_prio_spill_line(p, l, json, enqueued_ms);
+        pthread_mutex_unlock(&l->spill_lock);
+        free(json);
+    }
+
+    pthread_mutex_lock(&p->lock);
+    l->stats.submitted++;
+    if (err)
+    {
+        l->stats.rejected++;
+    }
+    else
+    {
+        l->stats.on_disk++;
+        l->stats.spilled++;
+
+        /* Every slot may have come free while the line was written, in which case no release is coming to 
+           read it back. Releases look at on_disk under the lock, so either they saw it or their slot is here. */
+        struct cpsh_queued *q = cpsh_mpool_get(&p->pool, 0);
+        if (q) cpsh_prio_release(p, q);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return err;
+}
+
+/*
+ * Appends a line to the spill file of a level: the time the message was queued, then the message as JSON. 
+ * The file is made on first use and unlinked at once, so nothing is left behind. Called with the level's spill 
+ * lock held.
+ */
+int
+cpsh_prio_spill_line(cpsh_prio *p, cpsh_prio_level *l, const char *json, unsigned long long enqueued_ms)
+{
+    if (!l->spill)
+    {
+        size_t len = strlen(p->spill_dir);
+        char *path = malloc(len + sizeof("/cpsh-spill-XXXXXX"));
+        if (!path)
+        {
+            return CPSH_ERR_NOMEM;
+        }
+        strcpy(path, p->spill_dir);
+        strcpy(path + len, "/cpsh-spill-XXXXXX");
+
+        int fd = mkstemp(path);
+        if (fd >= 0)
+        {
+            unlink(path);
+            if (!(l->spill = fdopen(fd, "w+"))) close(fd);
+        }
+        free(path);
+        if (!l->spill)
+        {
+            return CPSH_ERR_OVERLOAD;
+        }
+        l->spill_read = l->spill_write = 0;
+    }
+
+    if (fseek(l->spill, l->spill_write, SEEK_SET) || fprintf(l->spill, "%llu %s\n", enqueued_ms, json) < 0 
+        || fflush(l->spill))
+    {
+        /* Whatever made it out is past spill_write, so it is never read back */
+        return CPSH_ERR_OVERLOAD;
+    }
+    l->spill_write = ftell(l->spill);
+    return 0;
+}
+
+/*
+ * Reads the oldest spilled message of a level into slot q. Once the file is drained it is closed. Returns 0 
+ * on success; a line that can't be read back, or that was lost with an unreadable file, is an error. Called 
+ * with the level's spill lock held.
+ */
+int
+cpsh_prio_unspill(cpsh_prio_level *l, struct cpsh_queued *q)
+{
+    unsigned long long enqueued_ms;
+    int err = CPSH_ERR_MSG_FORMAT;
+    int n;
+
+    if (!l->spill)
+    {
+        return err;
+    }
+
+    if (fseek(l->spill, l->spill_read, SEEK_SET) == 0 && getline(&l->line, &l->line_size, l->spill) > 0)
+    {
+        l->spill_read = ftell(l->spill);
+        if (sscanf(l->line, "%llu %n", &enqueued_ms, &n) == 1 
+            && !cpsh_message_from_json(&q->msg, q->strings, l->line + n))
+        {
+            q->enqueued_ms = enqueued_ms;
+            err = 0;
+        }
+    }
+    else
+    {
+        l->spill_read = l->spill_write;
+    }
+
+    if (l->spill_read >= l->spill_write)
+    {
+        fclose(l->spill);
+        l->spill = NULL;
+    }
+    return err;
+}
+
+void *
+cpsh_prio_worker(void *argp)
+{
+    cpsh_prio_worker_arg *arg = (cpsh_prio_worker_arg *)argp;
+    cpsh_prio *p = arg->p;
+    int reserved = arg->reserved;
+    cpsh_conn conn = arg->conn;
+    free(arg);
+
+    pthread_mutex_lock(&p->lock);
+    while (p->running)
+    {
+        struct cpsh_queued *q = cpsh_prio_take(p, reserved);
+        if (!q)
+        {
+            pthread_cond_wait(&p->work, &p->lock);
+            continue;
+        }
+        pthread_mutex_unlock(&p->lock);
+
+        int err = cpsh_conn_send(&conn, &q->msg, NULL);
+        if (p->on_sent)
+        {
+            p->on_sent(&q->msg, err, p->userdata);
+        }
+
+        pthread_mutex_lock(&p->lock);
+        cpsh_prio_level *l = &p->levels[q->msg.priority - CPSH_PRIO_MIN];
+        if (err) l->stats.failed++; else l->stats.sent++;
+        cpsh_prio_release(p, q);
+    }
+    pthread_mutex_unlock(&p->lock);
+
+    cpsh_conn_cleanup(&conn);
+    return NULL;
+}
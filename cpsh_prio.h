@@ -0,0 +1,126 @@
+/*
+  Copyright (c) 2015 Christian Bjartli
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy 
+  of this software and associated documentation files (the "Software"), to deal 
+  in the Software without restriction, including without limitation the rights 
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or 
+  sell copies of the Software, and to permit persons to whom the Software is 
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all 
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE 
+  SOFTWARE.
+*/
+
+#ifndef CPSH_PRIO_H
+#define CPSH_PRIO_H
+
+#include <stdio.h>
+#include <pthread.h>
+#include "cpushover.h"
+#include "cpsh_mpool.h"
+
+/* Priority send scheduler. Messages are queued by their priority field, one FIFO per value, and sent by a pool 
+   of workers, each with its own persistent connection. Emergency (2) and high (1) priority messages are always 
+   taken first, and some workers are reserved for them, so their latency doesn't depend on how deep the lower 
+   queues are. Normal, low and lowest priority (0, -1, -2) share the rest by weighted round robin. */
+#define CPSH_PRIO_MIN -2    /* Range of the priority field, see BOUND in CPSH_API_FIELDS */
+#define CPSH_PRIO_MAX 2
+#define CPSH_PRIO_LEVELS (CPSH_PRIO_MAX - CPSH_PRIO_MIN + 1)
+#define CPSH_PRIO_STRICT 1  /* Levels from here up preempt the weighted ones */
+#define CPSH_PRIO_MAX_WORKERS 64
+
+/* Default round-robin weights of priority -2, -1 and 0 */
+#define CPSH_PRIO_WEIGHTS { 1, 2, 4 }
+
+/* What cpsh_prio_submit does when the memory budget set by cpsh_prio_set_budget is used up */
+#define CPSH_PRIO_BLOCK 0   /* Wait up to a timeout for a message to be sent, then fail with CPSH_ERR_OVERLOAD */
+#define CPSH_PRIO_REJECT 1  /* Fail with CPSH_ERR_OVERLOAD */
+#define CPSH_PRIO_DROP 2    /* Drop the oldest queued message of the lowest priority, unless it's above the new one */
+#define CPSH_PRIO_SPILL 3   /* Write the message to a file, and queue it again once there is room */
+
+/* Called on a worker thread after each send attempt, with the CPSH_ERR_* result (0 on success). */
+typedef void (*cpsh_prio_fn)(const cpsh_message*, int, void*);
+
+/* Per-level counters. Wait time runs from submission until a worker picks the message up. Rejected messages 
+   were refused by cpsh_prio_submit, dropped ones were pushed out of the queue by a newer message. */
+typedef struct
+{
+    size_t depth;
+    size_t on_disk;
+    unsigned long long submitted;
+    unsigned long long sent;
+    unsigned long long failed;
+    unsigned long long rejected;
+    unsigned long long dropped;
+    unsigned long long spilled;
+    unsigned long long wait_total_ms;
+    unsigned long long wait_max_ms;
+} cpsh_prio_stats;
+
+struct cpsh_queued;
+
+typedef struct
+{
+    struct cpsh_queued *head;
+    struct cpsh_queued *tail;
+    int weight;
+    int current;            /* Smooth weighted round-robin credit */
+    cpsh_prio_stats stats;
+    pthread_mutex_t spill_lock;     /* Guards the spill file, so its I/O doesn't hold up the other levels */
+    FILE *spill;
+    long spill_read;
+    long spill_write;
+    char *line;             /* For reading spilled messages back */
+    size_t line_size;
+} cpsh_prio_level;
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    int running;
+    unsigned nworkers;
+    unsigned reserved;
+    pthread_t workers[CPSH_PRIO_MAX_WORKERS];
+    cpsh_prio_level levels[CPSH_PRIO_LEVELS];   /* Indexed by priority - CPSH_PRIO_MIN */
+    cpsh_prio_fn on_sent;
+    void *userdata;
+    int bounded;            /* Queue entries come from pool rather than malloc */
+    cpsh_mpool pool;
+    int policy;
+    int timeout;
+    char *spill_dir;
+} cpsh_prio;
+
+/* Start worker threads, of which the first reserved only ever send priority 1 and 2 messages. 
+   on_sent may be NULL. Fails with CPSH_ERR_INIT, starting none, if a worker's connection can't be opened. */
+int cpsh_prio_init(cpsh_prio*, unsigned, unsigned, cpsh_prio_fn, void*);
+
+/* Bound the memory used by queued messages to budget bytes, and choose what happens to messages that don't fit: 
+   one of the CPSH_PRIO_* policies above. timeout (ms) is for CPSH_PRIO_BLOCK, and spill_dir, where spill files 
+   are made, for CPSH_PRIO_SPILL. Without this, the queues grow as needed. Call before submitting any message. */
+int cpsh_prio_set_budget(cpsh_prio*, size_t, int, int, const char*);
+
+/* Validate a message and queue a copy of it by its priority. Dropping a message to make room calls on_sent for 
+   it with CPSH_ERR_OVERLOAD. */
+int cpsh_prio_submit(cpsh_prio*, cpsh_message*);
+
+/* Read the counters of one priority level. */
+int cpsh_prio_get_stats(cpsh_prio*, int, cpsh_prio_stats*);
+
+/* Read the counters of the memory budget: slots in all, in use, the most ever in use at once, and how many 
+   submits found none free. Returns CPSH_ERR_INIT if no budget was set. */
+int cpsh_prio_get_pool_stats(cpsh_prio*, cpsh_mpool_stats*);
+
+/* Stop the workers once they finish their current send. Messages still queued are dropped, unsent. */
+void cpsh_prio_cleanup(cpsh_prio*);
+#endif
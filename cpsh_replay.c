@@ -0,0 +1,514 @@
+/*
+  Copyright (c) 2015 Christian Bjartli
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy 
+  of this software and associated documentation files (the "Software"), to deal 
+  in the Software without restriction, including without limitation the rights 
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or 
+  sell copies of the Software, and to permit persons to whom the Software is 
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all 
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE 
+  SOFTWARE.
+*/
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "cpsh_replay.h"
+
+#define CPSH_REPLAY_MAX_THREADS 64
+
+struct cpsh_replay_chunk;
+
+/* A non-blank line, and the message on it if it parsed */
+typedef struct
+{
+    struct cpsh_replay_chunk *chunk;
+    size_t offset;
+    size_t len;
+    int err;
+    int sending;            /* err came from the send rather than the parse */
+    cpsh_message msg;
+} cpsh_replay_line;
+
+typedef struct cpsh_replay_chunk
+{
+    size_t begin;
+    size_t end;
+    int parsed;
+    int err;                /* Out of memory while parsing it */
+    cpsh_replay_line *lines;
+    size_t nlines;
+    char *strings;          /* Strings of all its messages */
+    size_t pending;         /* Sends still in flight */
+} cpsh_replay_chunk;
+
+typedef struct
+{
+    const char *data;
+    cpsh_replay_chunk *chunks;
+    size_t nchunks;
+    pthread_mutex_t lock;
+    pthread_cond_t parsed;
+    pthread_cond_t room;
+    size_t next;            /* Next chunk to parse */
+    size_t sending;         /* Next chunk to send */
+    size_t ahead;           /* How many chunks parsing may run ahead of sending, and sending ahead of finishing */
+    int stopping;
+} cpsh_replay_ctx;
+
+/* Private prototypes */
+int cpsh_replay_file(const cpsh_replay_opts*, cpsh_replay_stats*, int, const char*, const char*);
+int cpsh_replay_run(cpsh_replay_ctx*, const cpsh_replay_opts*, cpsh_replay_stats*, FILE*, const char*);
+void *cpsh_replay_worker(void*);
+void cpsh_replay_parse(cpsh_replay_ctx*, cpsh_replay_chunk*, char*);
+void cpsh_replay_sent(int, cpsh_response*, void*);
+int cpsh_replay_finish(cpsh_replay_ctx*, cpsh_replay_chunk*, FILE*, const char*, cpsh_replay_stats*);
+char *cpsh_replay_path(const char*, const char*, const char*);
+
+int
+cpsh_replay(const cpsh_replay_opts *opts, cpsh_replay_stats *stats)
+{
+    char *reject_path = cpsh_replay_path(opts->reject_path, opts->path, ".rejects");
+    char *checkpoint_path = cpsh_replay_path(opts->checkpoint_path, opts->path, ".checkpoint");
+    int fd, err;
+
+    memset(stats, 0, sizeof(*stats));
+    if (!reject_path || !checkpoint_path)
+    {
+        err = CPSH_ERR_NOMEM;
+    }
+    else if ((fd = open(opts->path, O_RDONLY)) < 0)
+    {
+        err = CPSH_ERR_NOT_FOUND;
+    }
+    else
+    {
+        err = cpsh_replay_file(opts, stats, fd, reject_path, checkpoint_path);
+        close(fd);
+    }
+
+    free(reject_path);
+    free(checkpoint_path);
+    return err;
+}
+
+/*
+ * Maps the input, from the checkpoint on, and cuts it into chunks of whole lines
+ */
+int
+cpsh_replay_file(const cpsh_replay_opts *opts, cpsh_replay_stats *stats, int fd, const char *reject_path, 
+        const char *checkpoint_path)
+{
+    cpsh_replay_ctx ctx;
+    struct stat st;
+    FILE *f;
+    size_t i, size;
+
+    if (fstat(fd, &st))
+    {
+        return CPSH_ERR_IO;
+    }
+    size = st.st_size;
+
+    /* Pick up where the last run left off */
+    if ((f = fopen(checkpoint_path, "r")))
+    {
+        if (fscanf(f, "%zu", &stats->resumed_at) != 1 || stats->resumed_at > size)
+        {
+            stats->resumed_at = 0;
+        }
+        fclose(f);
+    }
+    stats->offset = stats->resumed_at;
+    if (stats->resumed_at == size)
+    {
+        return 0;
+    }
+
+    memset(&ctx, 0, sizeof(ctx));
+    void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED)
+    {
+        return CPSH_ERR_NOMEM;
+    }
+    madvise(map, size, MADV_SEQUENTIAL);
+    ctx.data = map;
+
+    ctx.chunks = calloc((size - stats->resumed_at) / CPSH_REPLAY_CHUNK + 1, sizeof(*ctx.chunks));
+    if (!ctx.chunks)
+    {
+        munmap(map, size);
+        return CPSH_ERR_NOMEM;
+    }
+    for (i = stats->resumed_at; i < size; ctx.nchunks++)
+    {
+        size_t end = i + CPSH_REPLAY_CHUNK;
+        const char *nl;
+        if (end >= size || !(nl = memchr(ctx.data + end, '\n', size - end)))
+        {
+            end = size;
+        }
+        else
+        {
+            end = nl - ctx.data + 1;
+        }
+        ctx.chunks[ctx.nchunks].begin = i;
+        ctx.chunks[ctx.nchunks].end = end;
+        i = end;
+    }
+
+    int err = CPSH_ERR_IO;
+    if ((f = fopen(reject_path, "a")))
+    {
+        err = cpsh_replay_run(&ctx, opts, stats, f, checkpoint_path);
+        fclose(f);
+    }
+
+    for (i = 0; i < ctx.nchunks; i++)
+    {
+        free(ctx.chunks[i].lines);
+        free(ctx.chunks[i].strings);
+    }
+    free(ctx.chunks);
+    munmap(map, size);
+    return err;
+}
+
+/*
+ * Starts the parsers and sends what they come up with
+ */
+int
+cpsh_replay_run(cpsh_replay_ctx *ctx, const cpsh_replay_opts *opts, cpsh_replay_stats *stats, FILE *rejects, 
+        const char *checkpoint_path)
+{
+    pthread_t threads[CPSH_REPLAY_MAX_THREADS];
+    unsigned nthreads = opts->threads, started;
+    unsigned window = opts->window ? opts->window : CPSH_REPLAY_WINDOW;
+    size_t i, sending, oldest;
+    cpsh_multi mc;
+    int err;
+
+    if ((err = cpsh_multi_init(&mc)))
+    {
+        return err;
+    }
+    if (nthreads == 0)
+    {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        nthreads = n > 0 ? n : 1;
+    }
+    if (nthreads > CPSH_REPLAY_MAX_THREADS)
+    {
+        nthreads = CPSH_REPLAY_MAX_THREADS;
+    }
+
+    ctx->ahead = 2 * nthreads;
+    pthread_mutex_init(&ctx->lock, NULL);
+    pthread_cond_init(&ctx->parsed, NULL);
+    pthread_cond_init(&ctx->room, NULL);
+    for (started = 0; started < nthreads; started++)
+    {
+        if (pthread_create(&threads[started], NULL, &cpsh_replay_worker, ctx))
+        {
+            break;
+        }
+    }
+    if (started == 0)
+    {
+        err = CPSH_ERR_INIT;
+    }
+
+    /* Send chunk by chunk, in file order. A chunk is finished with, and checkpointed, once all its sends are 
+       done, while the next ones are already going out. */
+    for (sending = 0, oldest = 0; oldest < ctx->nchunks && !err; )
+    {
+        int stop = opts->stop && *opts->stop;
+        cpsh_replay_chunk *c = NULL;
+
+        if (sending < ctx->nchunks && sending - oldest < ctx->ahead && !stop)
+        {
+            /* Only block on the parsers with nothing in flight, and never for long, so a stop is seen */
+            pthread_mutex_lock(&ctx->lock);
+            if (!ctx->chunks[sending].parsed && !mc.running)
+            {
+                struct timespec ts;
+                clock_gettime(CLOCK_REALTIME, &ts);
+                ts.tv_nsec += 100000000;
+                if (ts.tv_nsec >= 1000000000)
+                {
+                    ts.tv_sec++;
+                    ts.tv_nsec -= 1000000000;
+                }
+                pthread_cond_timedwait(&ctx->parsed, &ctx->lock, &ts);
+            }
+            if (ctx->chunks[sending].parsed)
+            {
+                c = &ctx->chunks[sending];
+            }
+            pthread_mutex_unlock(&ctx->lock);
+        }
+
+        if (c)
+        {
+            if ((err = c->err))
+            {
+                break;
+            }
+
+            for (i = 0; i < c->nlines; i++)
+            {
+                cpsh_replay_line *l = &c->lines[i];
+                if (l->err)
+                {
+                    continue;
+                }
+                while (mc.running >= window)
+                {
+                    cpsh_multi_run(&mc, 100);
+                }
+                c->pending++;
+                /* The parsers validated it already */
+                if ((l->err = cpsh_multi_submit_validated(&mc, &l->msg, &cpsh_replay_sent, l)))
+                {
+                    c->pending--;
+                    l->sending = 1;
+                }
+            }
+
+            /* Lets the parsers move on */
+            pthread_mutex_lock(&ctx->lock);
+            ctx->sending = ++sending;
+            pthread_cond_broadcast(&ctx->room);
+            pthread_mutex_unlock(&ctx->lock);
+        }
+        else if (stop && sending == oldest)
+        {
+            /* Stopping, and everything sent is finished with */
+            break;
+        }
+        else if (mc.running)
+        {
+            /* Waiting for sends to finish, or for a chunk still being parsed */
+            cpsh_multi_run(&mc, sending < ctx->nchunks && sending - oldest < ctx->ahead ? 10 : 100);
+        }
+
+        while (oldest < sending && ctx->chunks[oldest].pending == 0 && !err)
+        {
+            err = cpsh_replay_finish(ctx, &ctx->chunks[oldest++], rejects, checkpoint_path, stats);
+        }
+    }
+
+    /* Let the parsers go and wait for them */
+    pthread_mutex_lock(&ctx->lock);
+    ctx->stopping = 1;
+    pthread_cond_broadcast(&ctx->room);
+    pthread_mutex_unlock(&ctx->lock);
+    while (started > 0)
+    {
+        pthread_join(threads[--started], NULL);
+    }
+
+    cpsh_multi_cleanup(&mc);
+    pthread_mutex_destroy(&ctx->lock);
+    pthread_cond_destroy(&ctx->parsed);
+    pthread_cond_destroy(&ctx->room);
+    return err;
+}
+
+/*
+ * Parser thread. Takes chunks in order, staying at most ctx->ahead chunks in front of the sender. The chunk the 
+ * sender waits for is always within reach, whatever is still in flight.
+ */
+void *
+cpsh_replay_worker(void *arg)
+{
+    cpsh_replay_ctx *ctx = (cpsh_replay_ctx *)arg;
+    char line[CPSH_REPLAY_LINE_MAX + 1];
+
+    pthread_mutex_lock(&ctx->lock);
+    for (;;)
+    {
+        while (!ctx->stopping && ctx->next < ctx->nchunks && ctx->next >= ctx->sending + ctx->ahead)
+        {
+            pthread_cond_wait(&ctx->room, &ctx->lock);
+        }
+        if (ctx->stopping || ctx->next >= ctx->nchunks)
+        {
+            break;
+        }
+
+        cpsh_replay_chunk *c = &ctx->chunks[ctx->next++];
+        pthread_mutex_unlock(&ctx->lock);
+        cpsh_replay_parse(ctx, c, line);
+        pthread_mutex_lock(&ctx->lock);
+
+        c->parsed = 1;
+        pthread_cond_broadcast(&ctx->parsed);
+    }
+    pthread_mutex_unlock(&ctx->lock);
+    return NULL;
+}
+
+/*
+ * Parses and validates the lines of a chunk. line is scratch space for one line.
+ */
+void
+cpsh_replay_parse(cpsh_replay_ctx *ctx, cpsh_replay_chunk *c, char *line)
+{
+    const char *p = ctx->data + c->begin, *end = ctx->data + c->end;
+    size_t size = 0;
+
+    /* A message's strings take no more room than its line, so this always leaves a whole CPSH_MESSAGE_STRMAX 
+       for the next one */
+    char *strings = c->strings = malloc(c->end - c->begin + CPSH_MESSAGE_STRMAX);
+    if (!strings)
+    {
+        c->err = CPSH_ERR_NOMEM;
+        return;
+    }
+
+    while (p < end)
+    {
+        const char *nl = memchr(p, '\n', end - p);
+        size_t len = (nl ? nl : end) - p;
+        const char *next = p + len + 1;
+
+        if (len > 0 && p[len - 1] == '\r')
+        {
+            len--;
+        }
+        if (len == 0)
+        {
+            p = next;
+            continue;
+        }
+
+        if (c->nlines == size)
+        {
+            size = size ? 2 * size : 256;
+            cpsh_replay_line *lines = realloc(c->lines, size * sizeof(*lines));
+            if (!lines)
+            {
+                c->err = CPSH_ERR_NOMEM;
+                return;
+            }
+            c->lines = lines;
+        }
+
+        cpsh_replay_line *l = &c->lines[c->nlines++];
+        memset(l, 0, sizeof(*l));
+        l->chunk = c;
+        l->offset = p - ctx->data;
+        l->len = len;
+        if (len > CPSH_REPLAY_LINE_MAX)
+        {
+            l->err = CPSH_ERR_STRLEN;
+        }
+        else
+        {
+            memcpy(line, p, len);
+            line[len] = '\0';
+            if (!(l->err = cpsh_message_from_json(&l->msg, strings, line)) 
+                    && !(l->err = cpsh_validate_input(&l->msg)))
+            {
+                strings += cpsh_message_strsize(&l->msg);
+            }
+        }
+        p = next;
+    }
+}
+
+void
+cpsh_replay_sent(int err, cpsh_response *r, void *userdata)
+{
+    cpsh_replay_line *l = (cpsh_replay_line *)userdata;
+    (void)r;
+
+    l->err = err;
+    l->sending = 1;
+    l->chunk->pending--;
+}
+
+/*
+ * Records the outcome of a chunk whose sends are all done, and moves the checkpoint past it
+ */
+int
+cpsh_replay_finish(cpsh_replay_ctx *ctx, cpsh_replay_chunk *c, FILE *rejects, const char *checkpoint_path, 
+        cpsh_replay_stats *stats)
+{
+    size_t i;
+
+    for (i = 0; i < c->nlines; i++)
+    {
+        cpsh_replay_line *l = &c->lines[i];
+        if (l->err == 0)
+        {
+            stats->sent++;
+            continue;
+        }
+
+        if (l->sending) stats->failed++;
+        else stats->rejected++;
+        fprintf(rejects, "%zu\t%s\t%d\t", l->offset, l->sending ? "send" : "parse", l->err);
+        fwrite(ctx->data + l->offset, 1, l->len, rejects);
+        fputc('\n', rejects);
+    }
+    if (fflush(rejects))
+    {
+        return CPSH_ERR_IO;
+    }
+
+    /* Replace the checkpoint in one step, so it is never found half-written */
+    size_t len = strlen(checkpoint_path);
+    char tmp[len + sizeof(".tmp")];
+    memcpy(tmp, checkpoint_path, len);
+    memcpy(tmp + len, ".tmp", sizeof(".tmp"));
+
+    FILE *f = fopen(tmp, "w");
+    if (!f)
+    {
+        return CPSH_ERR_IO;
+    }
+    int bad = fprintf(f, "%zu\n", c->end) < 0;
+    bad |= fclose(f) != 0;
+    if (bad || rename(tmp, checkpoint_path))
+    {
+        return CPSH_ERR_IO;
+    }
+    stats->offset = c->end;
+
+    free(c->lines);
+    free(c->strings);
+    c->lines = NULL;
+    c->strings = NULL;
+    c->nlines = 0;
+    return 0;
+}
+
+char *
+cpsh_replay_path(const char *path, const char *base, const char *suffix)
+{
+    char *s = malloc((path ? strlen(path) : strlen(base) + strlen(suffix)) + 1);
+    if (s)
+    {
+        if (path) strcpy(s, path);
+        else strcat(strcpy(s, base), suffix);
+    }
+    return s;
+}
@@ -0,0 +1,61 @@
+/*
+  Copyright (c) 2015 Christian Bjartli
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy 
+  of this software and associated documentation files (the "Software"), to deal 
+  in the Software without restriction, including without limitation the rights 
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or 
+  sell copies of the Software, and to permit persons to whom the Software is 
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all 
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE 
+  SOFTWARE.
+*/
+
+#ifndef CPSH_REPLAY_H
+#define CPSH_REPLAY_H
+
+#include <signal.h>
+#include "cpushover.h"
+
+/* Bulk replay of a file of messages, one JSON object per line (see cpsh_message_from_json). The file is mapped 
+   and cut into chunks at line breaks, which a pool of threads parses and validates while the calling thread 
+   sends the valid messages concurrently over persistent connections. Lines that don't parse or validate, and 
+   messages the API refused or that couldn't be sent, are appended to the reject file as 
+   "offset<TAB>parse|send<TAB>error<TAB>line". After each chunk, the offset of the first line not yet dealt with 
+   is saved to the checkpoint file, and a later run resumes from there. */
+#define CPSH_REPLAY_CHUNK 1048576       /* Bytes per chunk, give or take a line */
+#define CPSH_REPLAY_LINE_MAX 65536      /* Longer lines are rejected unread */
+#define CPSH_REPLAY_WINDOW 32           /* Default number of sends in flight */
+
+typedef struct
+{
+    const char *path;
+    const char *reject_path;            /* Default: path + ".rejects" */
+    const char *checkpoint_path;        /* Default: path + ".checkpoint" */
+    unsigned threads;                   /* Parser threads. Default: one per CPU */
+    unsigned window;                    /* Most sends in flight at once */
+    volatile sig_atomic_t *stop;        /* Stop after the chunk in progress once this is set, if not NULL */
+} cpsh_replay_opts;
+
+typedef struct
+{
+    size_t resumed_at;                  /* Offset the run started from */
+    size_t offset;                      /* Where it got to */
+    unsigned long long sent;
+    unsigned long long rejected;        /* Lines that didn't parse or validate */
+    unsigned long long failed;          /* Messages that couldn't be sent */
+} cpsh_replay_stats;
+
+/* Runs a replay. Returns 0 if it got through the file, or stopped as asked, whatever happened to the messages 
+   in it; the stats say how many went where. */
+int cpsh_replay(const cpsh_replay_opts*, cpsh_replay_stats*);
+#endif
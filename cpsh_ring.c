@@ -0,0 +1,490 @@
+/*
+  Copyright (c) 2015 Christian Bjartli
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy 
+  of this software and associated documentation files (the "Software"), to deal 
+  in the Software without restriction, including without limitation the rights 
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or 
+  sell copies of the Software, and to permit persons to whom the Software is 
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all 
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE 
+  SOFTWARE.
+*/
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "cpsh_ring.h"
+
+#define CPSH_RING_MAGIC 0x48535043
+#define CPSH_RING_VERSION 2
+#define CPSH_RING_NAME_LN 255
+
+/* A message as stored in the ring: fixed size and free of pointers, so it reads the same in every process */
+#define GEN_RECORD(type, name, check, dep) GEN_RECORD_ ## type(name, check)
+#define GEN_RECORD_CHARPT(name, check) char name[CPSH_STRMAX_ ## check + 1];
+#define GEN_RECORD_TIMET(name, check) int64_t name;
+#define GEN_RECORD_SIGNCHAR(name, check) int64_t name;
+#define GEN_RECORD_SIZET(name, check) int64_t name;
+#define GEN_RECORD_ATTACH(name, check)
+typedef struct
+{
+    CPSH_API_FIELDS(GEN_RECORD)
+} cpsh_ring_record;
+
+/* seq is the slot's Vyukov sequence number: equal to the position it will be written at while free, one past it 
+   once written, and a lap further on once the consumer is done with it. While a producer writes it, it holds 
+   CPSH_RING_WRITING with the producer's pid and the low bits of the position instead. */
+#define CPSH_RING_WRITING (1ULL << 63)
+#define CPSH_RING_WRITER(pos, pid) (CPSH_RING_WRITING | (uint64_t)(uint32_t)(pid) << 32 | (uint32_t)(pos))
+
+typedef struct
+{
+    uint64_t seq;
+    uint32_t sum;
+    cpsh_ring_record rec;
+} __attribute__((aligned(64))) cpsh_ring_slot;
+
+/* Start of the shared mapping, followed by the slots. Producers and the consumer each get a cache line. */
+struct cpsh_ring_shm
+{
+    uint32_t magic;         /* Set last, once the ring is ready */
+    uint32_t version;
+    uint32_t nslots;
+    uint32_t slot_size;
+    unsigned long long full;
+    unsigned long long abandoned;
+    unsigned long long corrupt;
+    uint64_t head __attribute__((aligned(64)));     /* Next position to claim */
+    uint64_t tail __attribute__((aligned(64)));     /* Next position to consume */
+    uint32_t waiting;       /* Set while the consumer sleeps on it */
+};
+
+/* Private prototypes */
+int cpsh_ring_map(cpsh_ring*, const char*, int);
+cpsh_ring_slot *cpsh_ring_slot_at(struct cpsh_ring_shm*, uint64_t);
+void cpsh_ring_pack(cpsh_ring_record*, const cpsh_message*);
+void cpsh_ring_unpack(cpsh_message*, char*, const cpsh_ring_record*);
+uint32_t cpsh_ring_sum(const cpsh_ring_record*);
+int cpsh_ring_abandoned(cpsh_ring*, uint64_t, uint64_t);
+void cpsh_ring_wait(struct cpsh_ring_shm*, int);
+unsigned long long cpsh_ring_now_ms(void);
+
+unsigned long long
+cpsh_ring_now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int
+cpsh_ring_create(cpsh_ring *r, const char *name, unsigned slots)
+{
+    if (slots < 2 || (slots & (slots - 1)))
+    {
+        return CPSH_ERR_INIT;
+    }
+
+    int err;
+    if ((err = cpsh_ring_map(r, name, O_CREAT)))
+    {
+        return err;
+    }
+    if (flock(r->fd, LOCK_EX | LOCK_NB))
+    {
+        cpsh_ring_close(r);
+        return CPSH_ERR_INIT;
+    }
+
+    /* Take over a ring left by an earlier consumer, messages and all, if it's the same size. One that isn't 
+       may still be mapped by producers, who would fault if it shrank under them, so it is left alone. */
+    struct cpsh_ring_shm *shm = r->shm;
+    size_t size = sizeof(*shm) + (size_t) slots * sizeof(cpsh_ring_slot);
+    if (shm && __atomic_load_n(&shm->magic, __ATOMIC_ACQUIRE) == CPSH_RING_MAGIC)
+    {
+        if (r->size == size && shm->version == CPSH_RING_VERSION && shm->nslots == slots 
+                && shm->slot_size == sizeof(cpsh_ring_slot))
+        {
+            return 0;
+        }
+        cpsh_ring_close(r);
+        return CPSH_ERR_INIT;
+    }
+
+    /* Never finished, so no producer has it open */
+    if (shm)
+    {
+        munmap(shm, r->size);
+        r->shm = NULL;
+    }
+    if (ftruncate(r->fd, 0) || ftruncate(r->fd, size))
+    {
+        cpsh_ring_close(r);
+        return CPSH_ERR_NOMEM;
+    }
+    shm = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, r->fd, 0);
+    if (shm == MAP_FAILED)
+    {
+        cpsh_ring_close(r);
+        return CPSH_ERR_NOMEM;
+    }
+    r->shm = shm;
+    r->size = size;
+
+    shm->version = CPSH_RING_VERSION;
+    shm->nslots = slots;
+    shm->slot_size = sizeof(cpsh_ring_slot);
+    for (uint64_t i = 0; i < slots; i++)
+    {
+        cpsh_ring_slot_at(shm, i)->seq = i;
+    }
+    __atomic_store_n(&shm->magic, CPSH_RING_MAGIC, __ATOMIC_RELEASE);
+    return 0;
+}
+
+int
+cpsh_ring_open(cpsh_ring *r, const char *name)
+{
+    int err;
+    if ((err = cpsh_ring_map(r, name, 0)))
+    {
+        return err;
+    }
+
+    struct cpsh_ring_shm *shm = r->shm;
+    if (r->size < sizeof(*shm) || __atomic_load_n(&shm->magic, __ATOMIC_ACQUIRE) != CPSH_RING_MAGIC 
+            || shm->version != CPSH_RING_VERSION || shm->slot_size != sizeof(cpsh_ring_slot)
+            || r->size != sizeof(*shm) + (size_t) shm->nslots * sizeof(cpsh_ring_slot))
+    {
+        cpsh_ring_close(r);
+        return CPSH_ERR_NOT_FOUND;
+    }
+    return 0;
+}
+
+/*
+ * Opens and maps the ring's shared memory object as it is
+ */
+int
+cpsh_ring_map(cpsh_ring *r, const char *name, int flags)
+{
+    char path[CPSH_RING_NAME_LN + 2];
+    struct stat st;
+
+    memset(r, 0, sizeof(*r));
+    r->fd = -1;
+    r->pid = getpid();
+
+    if (snprintf(path, sizeof(path), "%s%s", name[0] == '/' ? "" : "/", name) >= (int) sizeof(path))
+    {
+        return CPSH_ERR_STRLEN;
+    }
+    if ((r->fd = shm_open(path, O_RDWR | flags, 0660)) < 0)
+    {
+        return CPSH_ERR_NOT_FOUND;
+    }
+    if (fstat(r->fd, &st) || st.st_size < (off_t) sizeof(struct cpsh_ring_shm))
+    {
+        /* A new ring, or one whose creator died before sizing it; the consumer will set it up */
+        if (flags & O_CREAT)
+        {
+            return 0;
+        }
+        cpsh_ring_close(r);
+        return CPSH_ERR_NOT_FOUND;
+    }
+
+    r->shm = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, r->fd, 0);
+    if (r->shm == MAP_FAILED)
+    {
+        r->shm = NULL;
+        cpsh_ring_close(r);
+        return CPSH_ERR_NOMEM;
+    }
+    r->size = st.st_size;
+    return 0;
+}
+
+cpsh_ring_slot *
+cpsh_ring_slot_at(struct cpsh_ring_shm *shm, uint64_t pos)
+{
+    return (cpsh_ring_slot *)(shm + 1) + (pos & (shm->nslots - 1));
+}
+
+int
+cpsh_ring_submit(cpsh_ring *r, cpsh_message *m)
+{
+    struct cpsh_ring_shm *shm = r->shm;
+    cpsh_ring_slot *s;
+    int err;
+
+    if ((err = cpsh_validate_input(m)))
+    {
+        return err;
+    }
+    if (m->attachment)
+    {
+        return CPSH_ERR_ATTACHMENT;
+    }
+
+    /* Claim a position. The slot there is free once its sequence has come round to it. */
+    uint64_t pos = __atomic_load_n(&shm->head, __ATOMIC_RELAXED);
+    for (;;)
+    {
+        s = cpsh_ring_slot_at(shm, pos);
+        uint64_t seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+        int64_t dif = (int64_t)(seq - pos);
+        if (seq & CPSH_RING_WRITING)
+        {
+            /* Someone else's already */
+            pos = __atomic_load_n(&shm->head, __ATOMIC_RELAXED);
+        }
+        else if (dif == 0)
+        {
+            if (__atomic_compare_exchange_n(&shm->head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                break;
+            }
+        }
+        else if (dif < 0)
+        {
+            __atomic_fetch_add(&shm->full, 1, __ATOMIC_RELAXED);
+            return CPSH_ERR_OVERLOAD;
+        }
+        else
+        {
+            pos = __atomic_load_n(&shm->head, __ATOMIC_RELAXED);
+        }
+    }
+
+    /* Mark the slot as ours before touching it, unless the consumer has given up on the claim in the meantime 
+       and the slot may already be someone else's. From here on, only our death makes the consumer skip it. */
+    uint64_t expected = pos;
+    if (!__atomic_compare_exchange_n(&s->seq, &expected, CPSH_RING_WRITER(pos, r->pid), 0, __ATOMIC_ACQUIRE, 
+                __ATOMIC_RELAXED))
+    {
+        return CPSH_ERR_OVERLOAD;
+    }
+
+    cpsh_ring_pack(&s->rec, m);
+    s->sum = cpsh_ring_sum(&s->rec);
+    __atomic_store_n(&s->seq, pos + 1, __ATOMIC_RELEASE);
+
+    /* Pairs with the fence in cpsh_ring_wait: either the consumer sees the message, or we see it waiting */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&shm->waiting, __ATOMIC_RELAXED) && __atomic_exchange_n(&shm->waiting, 0, __ATOMIC_RELAXED))
+    {
+        syscall(SYS_futex, &shm->waiting, FUTEX_WAKE, 1, NULL, NULL, 0);
+    }
+    return 0;
+}
+
+int
+cpsh_ring_consume(cpsh_ring *r, cpsh_message *m, char *buf, int timeout)
+{
+    struct cpsh_ring_shm *shm = r->shm;
+    unsigned long long deadline = cpsh_ring_now_ms() + (timeout > 0 ? timeout : 0);
+
+    for (;;)
+    {
+        uint64_t pos = __atomic_load_n(&shm->tail, __ATOMIC_RELAXED);
+        cpsh_ring_slot *s = cpsh_ring_slot_at(shm, pos);
+        uint64_t seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+        int wait_ms;
+
+        if (seq == pos + 1)
+        {
+            int ok = cpsh_ring_sum(&s->rec) == s->sum;
+            if (ok)
+            {
+                cpsh_ring_unpack(m, buf, &s->rec);
+            }
+            else
+            {
+                __atomic_fetch_add(&shm->corrupt, 1, __ATOMIC_RELAXED);
+            }
+
+            __atomic_store_n(&s->seq, pos + shm->nslots, __ATOMIC_RELEASE);
+            __atomic_store_n(&shm->tail, pos + 1, __ATOMIC_RELAXED);
+            if (ok)
+            {
+                return 0;
+            }
+            continue;
+        }
+        if (!(seq & CPSH_RING_WRITING) && (int64_t)(seq - pos) > 1)
+        {
+            /* Already consumed by a consumer that died before moving the tail on */
+            __atomic_store_n(&shm->tail, pos + 1, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        if (__atomic_load_n(&shm->head, __ATOMIC_ACQUIRE) != pos)
+        {
+            /* Claimed but not written yet. Skip it if its producer is gone, and otherwise look again shortly. */
+            if (cpsh_ring_abandoned(r, seq, pos))
+            {
+                uint64_t expected = seq;
+                if (__atomic_compare_exchange_n(&s->seq, &expected, pos + shm->nslots, 0, __ATOMIC_ACQ_REL, 
+                            __ATOMIC_ACQUIRE))
+                {
+                    __atomic_store_n(&shm->tail, pos + 1, __ATOMIC_RELAXED);
+                    __atomic_fetch_add(&shm->abandoned, 1, __ATOMIC_RELAXED);
+                }
+                continue;
+            }
+            wait_ms = 10;
+        }
+        else
+        {
+            wait_ms = INT32_MAX;
+        }
+
+        unsigned long long now = cpsh_ring_now_ms();
+        if (now >= deadline)
+        {
+            return CPSH_ERR_NOT_FOUND;
+        }
+        if (wait_ms > (int)(deadline - now))
+        {
+            wait_ms = deadline - now;
+        }
+
+        /* Announce that we're going to sleep, then look once more before doing so */
+        __atomic_store_n(&shm->waiting, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) == seq)
+        {
+            cpsh_ring_wait(shm, wait_ms);
+        }
+        __atomic_store_n(&shm->waiting, 0, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * Whether to give up on the producer that claimed the slot at pos without writing it yet, seq being what the 
+ * slot holds
+ */
+int
+cpsh_ring_abandoned(cpsh_ring *r, uint64_t seq, uint64_t pos)
+{
+    /* One that has marked the slot as its own is waited for as long as it lives */
+    if (seq & CPSH_RING_WRITING)
+    {
+        pid_t owner = (pid_t)((seq >> 32) & 0x7fffffff);
+        return kill(owner, 0) && errno == ESRCH;
+    }
+
+    /* One that hasn't yet is a moment away from it, or died on the way. Once it has had long enough, taking 
+       the slot from it is safe: it finds it gone, and leaves it alone. */
+    unsigned long long now = cpsh_ring_now_ms();
+    if (r->stall_pos != pos || r->stall_since == 0)
+    {
+        r->stall_pos = pos;
+        r->stall_since = now;
+    }
+    return now - r->stall_since >= CPSH_RING_STALL_MS;
+}
+
+void
+cpsh_ring_wait(struct cpsh_ring_shm *shm, int ms)
+{
+    struct timespec ts;
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (long)(ms % 1000) * 1000000;
+    syscall(SYS_futex, &shm->waiting, FUTEX_WAIT, 1, &ts, NULL, 0);
+}
+
+void
+cpsh_ring_pack(cpsh_ring_record *rec, const cpsh_message *m)
+{
+    /* Clear it all, padding included, so the checksum only depends on the message */
+    memset(rec, 0, sizeof(*rec));
+
+    #define GEN_PACK(type, name, check, dep) GEN_PACK_ ## type(name)
+    #define GEN_PACK_CHARPT(name) if (m-> name != NULL) strcpy(rec-> name, m-> name);
+    #define GEN_PACK_TIMET(name) rec-> name = m-> name;
+    #define GEN_PACK_SIGNCHAR(name) rec-> name = m-> name;
+    #define GEN_PACK_SIZET(name) rec-> name = m-> name;
+    #define GEN_PACK_ATTACH(name)
+
+    CPSH_API_FIELDS(GEN_PACK)
+}
+
+void
+cpsh_ring_unpack(cpsh_message *m, char *buf, const cpsh_ring_record *rec)
+{
+    memset(m, 0, sizeof(*m));
+
+    #define GEN_UNPACK(type, name, check, dep) GEN_UNPACK_ ## type(name)
+    #define GEN_UNPACK_CHARPT(name) if (rec-> name [0] != '\0') \
+        { m-> name = strcpy(buf, rec-> name); buf += strlen(buf) + 1; }
+    #define GEN_UNPACK_TIMET(name) m-> name = rec-> name;
+    #define GEN_UNPACK_SIGNCHAR(name) m-> name = rec-> name;
+    #define GEN_UNPACK_SIZET(name) m-> name = rec-> name;
+    #define GEN_UNPACK_ATTACH(name)
+
+    CPSH_API_FIELDS(GEN_UNPACK)
+}
+
+/*
+ * FNV-1a over the record a word at a time
+ */
+uint32_t
+cpsh_ring_sum(const cpsh_ring_record *rec)
+{
+    const uint64_t *w = (const uint64_t *)rec;
+    uint64_t h = 14695981039346656037ULL;
+
+    for (size_t i = 0; i < sizeof(*rec) / sizeof(*w); i++)
+    {
+        h = (h ^ w[i]) * 1099511628211ULL;
+    }
+    return (uint32_t)(h ^ (h >> 32));
+}
+
+void
+cpsh_ring_get_stats(cpsh_ring *r, cpsh_ring_stats *stats)
+{
+    struct cpsh_ring_shm *shm = r->shm;
+
+    stats->depth = __atomic_load_n(&shm->head, __ATOMIC_RELAXED) - __atomic_load_n(&shm->tail, __ATOMIC_RELAXED);
+    stats->full = __atomic_load_n(&shm->full, __ATOMIC_RELAXED);
+    stats->abandoned = __atomic_load_n(&shm->abandoned, __ATOMIC_RELAXED);
+    stats->corrupt = __atomic_load_n(&shm->corrupt, __ATOMIC_RELAXED);
+}
+
+void
+cpsh_ring_close(cpsh_ring *r)
+{
+    if (r->shm)
+    {
+        munmap(r->shm, r->size);
+    }
+    if (r->fd >= 0)
+    {
+        close(r->fd);
+    }
+    r->shm = NULL;
+    r->fd = -1;
+}
@@ -0,0 +1,76 @@
+/*
+  Copyright (c) 2015 Christian Bjartli
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy 
+  of this software and associated documentation files (the "Software"), to deal 
+  in the Software without restriction, including without limitation the rights 
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or 
+  sell copies of the Software, and to permit persons to whom the Software is 
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all 
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE 
+  SOFTWARE.
+*/
+
+#ifndef CPSH_RING_H
+#define CPSH_RING_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "cpushover.h"
+
+/* Shared-memory submission ring. Any number of producer processes on a host write messages into a ring in 
+   /dev/shm, and a single consumer (cpushover --ring) sends them over one warm connection. Submitting takes no 
+   system calls unless the consumer is asleep and has to be woken. A producer that dies halfway through writing 
+   a message costs only that message: the consumer skips its slot once the process is gone. One stalled for 
+   CPSH_RING_STALL_MS between claiming a slot and starting to write it loses the slot, and its submit fails. */
+#define CPSH_RING_SLOTS 1024        /* Default ring size, a power of two */
+#define CPSH_RING_STALL_MS 1000
+
+struct cpsh_ring_shm;
+
+typedef struct
+{
+    int fd;
+    struct cpsh_ring_shm *shm;
+    size_t size;
+    pid_t pid;              /* Ours, as recorded in the slots we write */
+    uint64_t stall_pos;     /* Consumer: unfinished slot it is waiting on, and since when */
+    unsigned long long stall_since;
+} cpsh_ring;
+
+/* Counters kept in the ring. full counts submissions refused because the ring was full, abandoned the slots 
+   skipped because their producer died or stalled, and corrupt the messages that failed their checksum. */
+typedef struct
+{
+    size_t depth;
+    unsigned long long full;
+    unsigned long long abandoned;
+    unsigned long long corrupt;
+} cpsh_ring_stats;
+
+/* Consumer side. Creates the ring with slots slots (a power of two), or takes over an existing one of that size 
+   along with the messages in it. Only one consumer can have a ring at a time; CPSH_ERR_INIT if there is one, or 
+   if the ring exists with another size or from another version, in which case it has to be removed first. */
+int cpsh_ring_create(cpsh_ring*, const char*, unsigned);
+
+/* Wait up to timeout ms for a message, copying it into the cpsh_message with its strings packed into buf, 
+   which must hold CPSH_MESSAGE_STRMAX bytes. Returns CPSH_ERR_NOT_FOUND if none arrived. */
+int cpsh_ring_consume(cpsh_ring*, cpsh_message*, char*, int);
+
+/* Producer side. A ring opened before fork() has to be opened again in the child. cpsh_ring_submit validates 
+   the message and returns CPSH_ERR_OVERLOAD if the ring is full. Attachments can't be sent this way. */
+int cpsh_ring_open(cpsh_ring*, const char*);
+int cpsh_ring_submit(cpsh_ring*, cpsh_message*);
+
+void cpsh_ring_get_stats(cpsh_ring*, cpsh_ring_stats*);
+void cpsh_ring_close(cpsh_ring*);
+#endif
@@ -0,0 +1,349 @@
+/*
+  Copyright (c) 2015 Christian Bjartli
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy 
+  of this software and associated documentation files (the "Software"), to deal 
+  in the Software without restriction, including without limitation the rights 
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or 
+  sell copies of the Software, and to permit persons to whom the Software is 
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all 
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE 
+  SOFTWARE.
+*/
+
+#include <string.h>
+#include <stdlib.h>
+#include "cpsh_tracker.h"
+
+#define CPSH_TRACKER_MIN_BUCKETS 64
+
+/* One tracked receipt. The timer comes first, so a timer pointer is also a pointer to its receipt. It is in the 
+   wheel, on the due list, or being polled. */
+typedef struct cpsh_tracked
+{
+    cpsh_timer timer;
+    struct cpsh_tracked *hnext;
+    cpsh_tracker *tracker;
+    void *userdata;
+    int queued;             /* On the due list */
+    int polling;
+    int cancelled;          /* Freed once its poll completes */
+    unsigned long hash;
+    char receipt[CPSH_RECEIPT_LN+1];
+} cpsh_tracked;
+
+/* Private prototypes */
+unsigned long long cpsh_tracker_ticks(void);
+unsigned long cpsh_tracker_hash(const char*);
+int cpsh_tracker_grow(cpsh_tracker*);
+cpsh_tracked **cpsh_tracker_find(cpsh_tracker*, const char*);
+void cpsh_tracker_unlink(cpsh_tracker*, cpsh_tracked*);
+void cpsh_tracker_due(cpsh_timer*, void*);
+void cpsh_tracker_polled(int, cpsh_receipt*, void*);
+
+/*
+ * Monotonic clock in tracker ticks
+ */
+unsigned long long
+cpsh_tracker_ticks(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((unsigned long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000) / CPSH_TRACKER_TICK_MS;
+}
+
+int
+cpsh_tracker_init(cpsh_tracker *tr, unsigned interval, cpsh_receipt_fn on_ack, cpsh_receipt_fn on_expire)
+{
+    int err;
+
+    memset(tr, 0, sizeof(*tr));
+    tr->buckets = calloc(CPSH_TRACKER_MIN_BUCKETS, sizeof(*tr->buckets));
+    if (!tr->buckets)
+    {
+        return CPSH_ERR_NOMEM;
+    }
+    tr->nbuckets = CPSH_TRACKER_MIN_BUCKETS;
+
+    if ((err = cpsh_multi_init(&tr->multi)))
+    {
+        free(tr->buckets);
+        tr->buckets = NULL;
+        return err;
+    }
+
+    if (interval < CPSH_TRACKER_MIN_INTERVAL)
+    {
+        interval = CPSH_TRACKER_MIN_INTERVAL;
+    }
+    tr->interval = (unsigned long long) interval * 1000 / CPSH_TRACKER_TICK_MS;
+    tr->window = CPSH_TRACKER_DEFAULT_WINDOW;
+    tr->on_ack = on_ack;
+    tr->on_expire = on_expire;
+    tr->due.next = tr->due.prev = &tr->due;
+    cpsh_wheel_init(&tr->wheel, cpsh_tracker_ticks());
+    return 0;
+}
+
+unsigned long
+cpsh_tracker_hash(const char *receipt)
+{
+    unsigned long h = 5381;
+    const char *c;
+    for (c = receipt; *c != '\0'; c++)
+    {
+        h = h * 33 + (unsigned char) *c;
+    }
+    return h;
+}
+
+/*
+ * Doubles the receipt table
+ */
+int
+cpsh_tracker_grow(cpsh_tracker *tr)
+{
+    size_t n = tr->nbuckets * 2, i;
+    cpsh_tracked **buckets = calloc(n, sizeof(*buckets));
+    if (!buckets)
+    {
+        return CPSH_ERR_NOMEM;
+    }
+
+    for (i = 0; i < tr->nbuckets; i++)
+    {
+        cpsh_tracked *t = tr->buckets[i];
+        while (t)
+        {
+            cpsh_tracked *next = t->hnext;
+            t->hnext = buckets[t->hash % n];
+            buckets[t->hash % n] = t;
+            t = next;
+        }
+    }
+    free(tr->buckets);
+    tr->buckets = buckets;
+    tr->nbuckets = n;
+    return 0;
+}
+
+/*
+ * Finds the link to a receipt still tracked, or NULL
+ */
+cpsh_tracked **
+cpsh_tracker_find(cpsh_tracker *tr, const char *receipt)
+{
+    cpsh_tracked **link = &tr->buckets[cpsh_tracker_hash(receipt) % tr->nbuckets];
+    for (; *link; link = &(*link)->hnext)
+    {
+        if (!(*link)->cancelled && strcmp((*link)->receipt, receipt) == 0)
+        {
+            return link;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Takes a receipt out of the table
+ */
+void
+cpsh_tracker_unlink(cpsh_tracker *tr, cpsh_tracked *t)
+{
+    cpsh_tracked **link = &tr->buckets[t->hash % tr->nbuckets];
+    while (*link != t)
+    {
+        link = &(*link)->hnext;
+    }
+    *link = t->hnext;
+}
+
+int
+cpsh_tracker_add(cpsh_tracker *tr, const char *receipt, void *userdata)
+{
+    if (strlen(receipt) != CPSH_RECEIPT_LN)
+    {
+        return CPSH_ERR_MSG_FORMAT;
+    }
+    if (cpsh_tracker_find(tr, receipt))
+    {
+        return CPSH_ERR_DUPLICATE;
+    }
+    if (tr->pending >= tr->nbuckets && cpsh_tracker_grow(tr))
+    {
+        return CPSH_ERR_NOMEM;
+    }
+
+    cpsh_tracked *t = calloc(1, sizeof(*t));
+    if (!t)
+    {
+        return CPSH_ERR_NOMEM;
+    }
+    strcpy(t->receipt, receipt);
+    t->tracker = tr;
+    t->userdata = userdata;
+    t->hash = cpsh_tracker_hash(receipt);
+    t->hnext = tr->buckets[t->hash % tr->nbuckets];
+    tr->buckets[t->hash % tr->nbuckets] = t;
+
+    /* Receipts are random, so hashing one gives an evenly spread phase within the interval */
+    cpsh_wheel_add(&tr->wheel, &t->timer, tr->wheel.now + tr->interval + t->hash % tr->interval);
+    tr->pending++;
+    return 0;
+}
+
+int
+cpsh_tracker_cancel(cpsh_tracker *tr, const char *receipt)
+{
+    cpsh_tracked **link = cpsh_tracker_find(tr, receipt);
+    if (!link)
+    {
+        return CPSH_ERR_NOT_FOUND;
+    }
+
+    cpsh_tracked *t = *link;
+    tr->pending--;
+
+    /* The poll in flight still refers to it */
+    if (t->polling)
+    {
+        t->cancelled = 1;
+        return 0;
+    }
+
+    *link = t->hnext;
+    if (t->queued)
+    {
+        t->timer.prev->next = t->timer.next;
+        t->timer.next->prev = t->timer.prev;
+    }
+    else
+    {
+        cpsh_wheel_del(&tr->wheel, &t->timer);
+    }
+    free(t);
+    return 0;
+}
+
+/*
+ * Wheel callback: queue the receipt for polling
+ */
+void
+cpsh_tracker_due(cpsh_timer *t, void *userdata)
+{
+    cpsh_tracker *tr = (cpsh_tracker *)userdata;
+
+    t->next = &tr->due;
+    t->prev = tr->due.prev;
+    tr->due.prev->next = t;
+    tr->due.prev = t;
+    ((cpsh_tracked *) t)->queued = 1;
+}
+
+size_t
+cpsh_tracker_run(cpsh_tracker *tr)
+{
+    size_t polls = 0;
+
+    cpsh_wheel_advance(&tr->wheel, cpsh_tracker_ticks(), &cpsh_tracker_due, tr);
+
+    while (tr->polling < tr->window && tr->due.next != &tr->due)
+    {
+        cpsh_tracked *t = (cpsh_tracked *) tr->due.next;
+        t->timer.prev->next = t->timer.next;
+        t->timer.next->prev = t->timer.prev;
+        t->timer.next = t->timer.prev = NULL;
+        t->queued = 0;
+
+        /* Couldn't even start it: try again next interval */
+        if (cpsh_multi_poll_receipt(&tr->multi, t->receipt, &cpsh_tracker_polled, t))
+        {
+            cpsh_wheel_add(&tr->wheel, &t->timer, tr->wheel.now + tr->interval);
+            continue;
+        }
+        t->polling = 1;
+        tr->polling++;
+        polls++;
+    }
+
+    cpsh_multi_run(&tr->multi, 0);
+    return polls;
+}
+
+/*
+ * Poll callback: hand the receipt to the caller if it is done with, and schedule the next poll if not
+ */
+void
+cpsh_tracker_polled(int err, cpsh_receipt *status, void *userdata)
+{
+    cpsh_tracked *t = (cpsh_tracked *)userdata;
+    cpsh_tracker *tr = t->tracker;
+
+    t->polling = 0;
+    tr->polling--;
+
+    if (t->cancelled)
+    {
+        cpsh_tracker_unlink(tr, t);
+        free(t);
+        return;
+    }
+
+    /* Trouble on the way, or still waiting for the user: try again next interval */
+    if ((err && err != CPSH_ERR_NOT_FOUND) || (!err && !status->acknowledged && !status->expired))
+    {
+        cpsh_wheel_add(&tr->wheel, &t->timer, tr->wheel.now + tr->interval);
+        return;
+    }
+
+    /* Out of the table first, so the callback may add the receipt again */
+    cpsh_tracker_unlink(tr, t);
+    tr->pending--;
+    if (!err && status->acknowledged)
+    {
+        if (tr->on_ack) tr->on_ack(t->receipt, status, t->userdata);
+    }
+    else
+    {
+        /* Expired, or the API turned the receipt down */
+        if (tr->on_expire) tr->on_expire(t->receipt, status, t->userdata);
+    }
+    free(t);
+}
+
+void
+cpsh_tracker_cleanup(cpsh_tracker *tr)
+{
+    size_t i;
+
+    /* Drops the polls in flight without calling back; every receipt is still in the table */
+    cpsh_multi_cleanup(&tr->multi);
+
+    for (i = 0; i < tr->nbuckets; i++)
+    {
+        cpsh_tracked *t = tr->buckets[i];
+        while (t)
+        {
+            cpsh_tracked *next = t->hnext;
+            free(t);
+            t = next;
+        }
+    }
+    free(tr->buckets);
+    tr->buckets = NULL;
+    tr->nbuckets = 0;
+
+    cpsh_wheel_init(&tr->wheel, tr->wheel.now);
+    tr->due.next = tr->due.prev = &tr->due;
+    tr->polling = 0;
+    tr->pending = 0;
+}
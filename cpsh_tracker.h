@@ -0,0 +1,76 @@
+/*
+  Copyright (c) 2015 Christian Bjartli
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy 
+  of this software and associated documentation files (the "Software"), to deal 
+  in the Software without restriction, including without limitation the rights 
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or 
+  sell copies of the Software, and to permit persons to whom the Software is 
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all 
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE 
+  SOFTWARE.
+*/
+
+#ifndef CPSH_TRACKER_H
+#define CPSH_TRACKER_H
+
+#include "cpushover.h"
+#include "cpsh_wheel.h"
+
+/* Receipt tracker. Keeps track of emergency-priority messages until they are acknowledged or expire, polling
+   the receipts API for each on a timing wheel. Polls run concurrently on a cpsh_multi. Each receipt is polled 
+   once per interval, at a phase derived from the receipt itself, so receipts added together don't all come due 
+   together. */
+#define CPSH_TRACKER_TICK_MS 100
+#define CPSH_TRACKER_MIN_INTERVAL 5         /* Pushover asks for no more than one poll per receipt every 5 seconds */
+#define CPSH_TRACKER_DEFAULT_WINDOW 256     /* Most polls in flight at once */
+
+/* Called with the receipt, its last polled status, and the userdata it was added with. */
+typedef void (*cpsh_receipt_fn)(const char*, const cpsh_receipt*, void*);
+
+struct cpsh_tracked;
+
+typedef struct
+{
+    cpsh_wheel wheel;
+    cpsh_multi multi;
+    cpsh_timer due;     /* Receipts whose poll is due, oldest first */
+    struct cpsh_tracked **buckets;      /* Every receipt, by hash of the receipt */
+    size_t nbuckets;
+    unsigned long long interval;
+    size_t window;
+    size_t polling;
+    size_t pending;
+    cpsh_receipt_fn on_ack;
+    cpsh_receipt_fn on_expire;
+} cpsh_tracker;
+
+/* Set up a tracker polling every interval seconds (at least CPSH_TRACKER_MIN_INTERVAL). on_ack is called when
+   a receipt is acknowledged, on_expire when it expires unacknowledged or the API no longer knows it. Either
+   may be NULL. Receipts are dropped after their callback. */
+int cpsh_tracker_init(cpsh_tracker*, unsigned, cpsh_receipt_fn, cpsh_receipt_fn);
+
+/* Start tracking a receipt, e.g. cpsh_response.receipt from cpsh_conn_send. Returns CPSH_ERR_DUPLICATE if it is 
+   tracked already. */
+int cpsh_tracker_add(cpsh_tracker*, const char*, void*);
+
+/* Stop tracking a receipt without calling back. Returns CPSH_ERR_NOT_FOUND if it isn't being tracked. */
+int cpsh_tracker_cancel(cpsh_tracker*, const char*);
+
+/* Start polls for the receipts that are due, keeping at most tracker->window in flight; the rest wait for the 
+   next call. Then handle the polls that have completed, without waiting for any. Call this at least every 
+   CPSH_TRACKER_TICK_MS. Returns the number of polls started. */
+size_t cpsh_tracker_run(cpsh_tracker*);
+
+/* Stop tracking everything, without calling any callbacks, and drop the polls in flight. */
+void cpsh_tracker_cleanup(cpsh_tracker*);
+#endif
@@ -0,0 +1,539 @@
+/*
+  Copyright (c) 2015 Christian Bjartli
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy 
+  of this software and associated documentation files (the "Software"), to deal 
+  in the Software without restriction, including without limitation the rights 
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or 
+  sell copies of the Software, and to permit persons to whom the Software is 
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all 
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE 
+  SOFTWARE.
+*/
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include "cpsh_vcache.h"
+#include "cJSON.h"
+
+/* Sounds gathered by one fetch */
+typedef struct
+{
+    char names[CPSH_VCACHE_SOUNDS][CPSH_VCACHE_SOUND_LN+1];
+    size_t n;
+    int overflow;
+} cpsh_sound_list;
+
+/* Private prototypes */
+cpsh_vcache_entry *cpsh_vcache_set(cpsh_vcache*, cpsh_strview, cpsh_strview);
+cpsh_vcache_entry *cpsh_vcache_find(cpsh_vcache*, cpsh_strview, cpsh_strview, time_t);
+void cpsh_vcache_put(cpsh_vcache*, cpsh_strview, cpsh_strview, int, time_t);
+int cpsh_vcache_has_sound(cpsh_vcache*, cpsh_strview);
+void cpsh_vcache_add_sound(const char*, void*);
+cJSON *cpsh_vcache_to_json(cpsh_vcache*, time_t);
+int cpsh_vcache_check_json(cJSON*);
+void cpsh_vcache_from_json(cpsh_vcache*, cJSON*, time_t);
+size_t cpsh_vcache_write(const char*, size_t, void*);
+
+static const cpsh_strview cpsh_vcache_none = { "", 0 };
+
+int
+cpsh_vcache_init(cpsh_vcache *c, size_t entries)
+{
+    memset(c, 0, sizeof(*c));
+
+    size_t n = CPSH_VCACHE_WAYS;
+    if (!entries)
+    {
+        entries = CPSH_VCACHE_ENTRIES;
+    }
+    while (n < entries)
+    {
+        n <<= 1;
+    }
+
+    c->entries = calloc(n, sizeof(*c->entries));
+    if (!c->entries)
+    {
+        return CPSH_ERR_NOMEM;
+    }
+    if (pthread_rwlock_init(&c->lock, NULL))
+    {
+        free(c->entries);
+        c->entries = NULL;
+        return CPSH_ERR_NOMEM;
+    }
+
+    c->mask = n - 1;
+    c->valid_ttl = CPSH_VCACHE_VALID_TTL;
+    c->invalid_ttl = CPSH_VCACHE_INVALID_TTL;
+    c->sounds_ttl = CPSH_VCACHE_SOUNDS_TTL;
+    return 0;
+}
+
+void
+cpsh_set_vcache(cpsh_vcache *c)
+{
+    if (c) cpsh_set_validator(c, &cpsh_vcache_check, &cpsh_vcache_learn);
+    else cpsh_set_validator(NULL, NULL, NULL);
+}
+
+void
+cpsh_vcache_cleanup(cpsh_vcache *c)
+{
+    if (c->entries)
+    {
+        pthread_rwlock_destroy(&c->lock);
+        free(c->entries);
+        c->entries = NULL;
+    }
+}
+
+/*
+ * First entry of the set a user and device belong in
+ */
+cpsh_vcache_entry *
+cpsh_vcache_set(cpsh_vcache *c, cpsh_strview user, cpsh_strview device)
+{
+    /* FNV-1a */
+    unsigned long h = 2166136261UL;
+    size_t i;
+    for (i = 0; i < user.len; i++) h = (h ^ (unsigned char)user.ptr[i]) * 16777619UL;
+    h = (h ^ ':') * 16777619UL;
+    for (i = 0; i < device.len; i++) h = (h ^ (unsigned char)device.ptr[i]) * 16777619UL;
+    h ^= h >> 15;
+
+    return &c->entries[h & c->mask & ~(size_t)(CPSH_VCACHE_WAYS - 1)];
+}
+
+/*
+ * Looks up an unexpired entry. Both strings must fit an entry.
+ */
+cpsh_vcache_entry *
+cpsh_vcache_find(cpsh_vcache *c, cpsh_strview user, cpsh_strview device, time_t now)
+{
+    cpsh_vcache_entry *e = cpsh_vcache_set(c, user, device);
+    cpsh_vcache_entry *end = e + CPSH_VCACHE_WAYS;
+
+    for (; e < end; e++)
+    {
+        if (e->expires > now 
+                && memcmp(e->user, user.ptr, user.len) == 0 && e->user[user.len] == '\0'
+                && memcmp(e->device, device.ptr, device.len) == 0 && e->device[device.len] == '\0')
+        {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Adds or updates an entry, under the write lock. A full set loses the entry that expires first.
+ */
+void
+cpsh_vcache_put(cpsh_vcache *c, cpsh_strview user, cpsh_strview device, int valid, time_t expires)
+{
+    cpsh_vcache_entry *e = cpsh_vcache_set(c, user, device);
+    cpsh_vcache_entry *end = e + CPSH_VCACHE_WAYS;
+    cpsh_vcache_entry *victim = e;
+
+    for (; e < end; e++)
+    {
+        if (memcmp(e->user, user.ptr, user.len) == 0 && e->user[user.len] == '\0'
+                && memcmp(e->device, device.ptr, device.len) == 0 && e->device[device.len] == '\0')
+        {
+            victim = e;
+            break;
+        }
+        if (e->expires < victim->expires)
+        {
+            victim = e;
+        }
+    }
+
+    memcpy(victim->user, user.ptr, user.len);
+    victim->user[user.len] = '\0';
+    memcpy(victim->device, device.ptr, device.len);
+    victim->device[device.len] = '\0';
+    victim->valid = valid;
+    victim->expires = expires;
+}
+
+int
+cpsh_vcache_has_sound(cpsh_vcache *c, cpsh_strview sound)
+{
+    size_t i;
+    for (i = 0; i < c->nsounds; i++)
+    {
+        if (memcmp(c->sounds[i], sound.ptr, sound.len) == 0 && c->sounds[i][sound.len] == '\0')
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Checks a validated message against what the cache knows
+ */
+int
+cpsh_vcache_check(cpsh_vcache *c, const cpsh_message_view *v)
+{
+    time_t now = time(NULL);
+    cpsh_vcache_entry *e;
+    int err = 0;
+
+    pthread_rwlock_rdlock(&c->lock);
+    if ((e = cpsh_vcache_find(c, v->user, cpsh_vcache_none, now)) && !e->valid)
+    {
+        err = CPSH_ERR_BAD_RECIPIENT;
+    }
+    else if (v->device.len && (e = cpsh_vcache_find(c, v->user, v->device, now)) && !e->valid)
+    {
+        err = CPSH_ERR_BAD_RECIPIENT;
+    }
+    else if (v->sound.len && c->sounds_expire > now && !cpsh_vcache_has_sound(c, v->sound))
+    {
+        err = CPSH_ERR_BAD_SOUND;
+    }
+    pthread_rwlock_unlock(&c->lock);
+
+    return err;
+}
+
+int
+cpsh_vcache_validate_user(cpsh_vcache *c, cpsh_conn *conn, const char *user, const char *device)
+{
+    cpsh_strview u = { user, strlen(user) };
+    cpsh_strview d = { device ? device : "", device ? strlen(device) : 0 };
+    if (u.len > CPSH_VCACHE_USER_LN || d.len > CPSH_VCACHE_DEVICE_LN)
+    {
+        return CPSH_ERR_MSG_FORMAT;
+    }
+
+    /* An invalid user key rules out all its devices */
+    time_t now = time(NULL);
+    cpsh_vcache_entry *e;
+    int known = -1;
+    pthread_rwlock_rdlock(&c->lock);
+    if ((e = cpsh_vcache_find(c, u, cpsh_vcache_none, now)) && (!e->valid || !d.len))
+    {
+        known = e->valid;
+    }
+    else if (d.len && (e = cpsh_vcache_find(c, u, d, now)))
+    {
+        known = e->valid;
+    }
+    pthread_rwlock_unlock(&c->lock);
+
+    if (known >= 0)
+    {
+        return known ? 0 : CPSH_ERR_BAD_RECIPIENT;
+    }
+
+    unsigned invalid = 0;
+    int err = cpsh_user_validate(conn, user, device, &invalid);
+    if (err == CPSH_ERR_BAD_RECIPIENT)
+    {
+        cpsh_vcache_learn(c, u, d, invalid);
+    }
+    else if (!err)
+    {
+        pthread_rwlock_wrlock(&c->lock);
+        cpsh_vcache_put(c, u, cpsh_vcache_none, 1, now + c->valid_ttl);
+        if (d.len) cpsh_vcache_put(c, u, d, 1, now + c->valid_ttl);
+        pthread_rwlock_unlock(&c->lock);
+    }
+    return err;
+}
+
+void
+cpsh_vcache_learn(cpsh_vcache *c, cpsh_strview user, cpsh_strview device, unsigned invalid)
+{
+    if (user.len > CPSH_VCACHE_USER_LN || device.len > CPSH_VCACHE_DEVICE_LN)
+    {
+        return;
+    }
+
+    time_t expires = time(NULL) + c->invalid_ttl;
+    pthread_rwlock_wrlock(&c->lock);
+    if (invalid & CPSH_INVALID_USER)
+    {
+        cpsh_vcache_put(c, user, cpsh_vcache_none, 0, expires);
+    }
+    else if ((invalid & CPSH_INVALID_DEVICE) && device.len)
+    {
+        cpsh_vcache_put(c, user, device, 0, expires);
+    }
+    pthread_rwlock_unlock(&c->lock);
+}
+
+void
+cpsh_vcache_add_sound(const char *name, void *userdata)
+{
+    cpsh_sound_list *l = (cpsh_sound_list *)userdata;
+    size_t len = strlen(name);
+
+    /* A name too long for the sound field can't be sent anyway */
+    if (len > CPSH_VCACHE_SOUND_LN)
+    {
+        return;
+    }
+    if (l->n == CPSH_VCACHE_SOUNDS)
+    {
+        l->overflow = 1;
+        return;
+    }
+    memcpy(l->names[l->n++], name, len + 1);
+}
+
+int
+cpsh_vcache_fetch_sounds(cpsh_vcache *c, cpsh_conn *conn)
+{
+    time_t now = time(NULL);
+    int fresh;
+    pthread_rwlock_rdlock(&c->lock);
+    fresh = c->sounds_expire > now;
+    pthread_rwlock_unlock(&c->lock);
+    if (fresh)
+    {
+        return 0;
+    }
+
+    cpsh_sound_list l;
+    int err;
+    l.n = 0;
+    l.overflow = 0;
+    if ((err = cpsh_sounds_list(conn, &cpsh_vcache_add_sound, &l)))
+    {
+        return err;
+    }
+
+    pthread_rwlock_wrlock(&c->lock);
+    c->nsounds = l.overflow ? 0 : l.n;
+    memcpy(c->sounds, l.names, c->nsounds * sizeof(l.names[0]));
+    c->sounds_expire = l.overflow ? 0 : now + c->sounds_ttl;
+    pthread_rwlock_unlock(&c->lock);
+    return 0;
+}
+
+size_t
+cpsh_vcache_write(const char *data, size_t len, void *userdata)
+{
+    return fwrite(data, 1, len, (FILE *)userdata);
+}
+
+/*
+ * Renders the unexpired contents as JSON, under the read lock
+ */
+cJSON *
+cpsh_vcache_to_json(cpsh_vcache *c, time_t now)
+{
+    cJSON *o = cJSON_CreateObject();
+    cJSON *entries = cJSON_CreateArray();
+    if (!o || !entries)
+    {
+        cJSON_Delete(o);
+        cJSON_Delete(entries);
+        return NULL;
+    }
+    cJSON_AddItemToObject(o, "entries", entries);
+
+    size_t i;
+    for (i = 0; i <= c->mask; i++)
+    {
+        const cpsh_vcache_entry *e = &c->entries[i];
+        cJSON *item;
+        if (e->expires <= now || !(item = cJSON_CreateObject()))
+        {
+            continue;
+        }
+        cJSON_AddStringToObject(item, "user", e->user);
+        cJSON_AddStringToObject(item, "device", e->device);
+        cJSON_AddBoolToObject(item, "valid", e->valid);
+        cJSON_AddNumberToObject(item, "expires", (double) e->expires);
+        cJSON_AddItemToArray(entries, item);
+    }
+
+    if (c->sounds_expire > now)
+    {
+        cJSON *sounds = cJSON_CreateArray();
+        if (sounds)
+        {
+            for (i = 0; i < c->nsounds; i++)
+            {
+                cJSON_AddItemToArray(sounds, cJSON_CreateString(c->sounds[i]));
+            }
+            cJSON_AddItemToObject(o, "sounds", sounds);
+            cJSON_AddNumberToObject(o, "sounds_expire", (double) c->sounds_expire);
+        }
+    }
+    return o;
+}
+
+int
+cpsh_vcache_save(cpsh_vcache *c, const char *path)
+{
+    time_t now = time(NULL);
+    pthread_rwlock_rdlock(&c->lock);
+    cJSON *o = cpsh_vcache_to_json(c, now);
+    pthread_rwlock_unlock(&c->lock);
+    if (!o)
+    {
+        return CPSH_ERR_NOMEM;
+    }
+
+    /* Written aside and renamed into place, so a crash never leaves half a snapshot */
+    size_t len = strlen(path);
+    char tmp[len + sizeof(".tmp")];
+    memcpy(tmp, path, len);
+    memcpy(tmp + len, ".tmp", sizeof(".tmp"));
+
+    FILE *f = fopen(tmp, "w");
+    if (!f)
+    {
+        cJSON_Delete(o);
+        return CPSH_ERR_IO;
+    }
+    int bad = !cJSON_PrintStream(o, 0, &cpsh_vcache_write, f);
+    bad |= fclose(f) != 0;
+    cJSON_Delete(o);
+    if (bad || rename(tmp, path))
+    {
+        return CPSH_ERR_IO;
+    }
+    return 0;
+}
+
+/*
+ * Checks a whole snapshot before any of it is used, so a malformed one changes nothing
+ */
+int
+cpsh_vcache_check_json(cJSON *o)
+{
+    cJSON *entries = cJSON_GetObjectItem(o, "entries");
+    cJSON *sounds = cJSON_GetObjectItem(o, "sounds");
+    cJSON *sounds_expire = cJSON_GetObjectItem(o, "sounds_expire");
+    cJSON *e;
+    size_t n = 0;
+
+    if ((entries && entries->type != cJSON_Array) || (sounds && sounds->type != cJSON_Array) 
+            || (sounds_expire && sounds_expire->type != cJSON_Number))
+    {
+        return CPSH_ERR_MSG_FORMAT;
+    }
+
+    for (e = entries ? entries->child : NULL; e != NULL; e = e->next)
+    {
+        cJSON *user = cJSON_GetObjectItem(e, "user");
+        cJSON *device = cJSON_GetObjectItem(e, "device");
+        cJSON *valid = cJSON_GetObjectItem(e, "valid");
+        cJSON *expires = cJSON_GetObjectItem(e, "expires");
+        if (!user || user->type != cJSON_String || !device || device->type != cJSON_String || !valid 
+                || (valid->type != cJSON_True && valid->type != cJSON_False) 
+                || !expires || expires->type != cJSON_Number
+                || strlen(user->valuestring) > CPSH_VCACHE_USER_LN 
+                || strlen(device->valuestring) > CPSH_VCACHE_DEVICE_LN)
+        {
+            return CPSH_ERR_MSG_FORMAT;
+        }
+    }
+
+    for (e = sounds ? sounds->child : NULL; e != NULL; e = e->next, n++)
+    {
+        if (e->type != cJSON_String || strlen(e->valuestring) > CPSH_VCACHE_SOUND_LN || n == CPSH_VCACHE_SOUNDS)
+        {
+            return CPSH_ERR_MSG_FORMAT;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Adds the unexpired contents of a checked snapshot, under the write lock
+ */
+void
+cpsh_vcache_from_json(cpsh_vcache *c, cJSON *o, time_t now)
+{
+    cJSON *entries = cJSON_GetObjectItem(o, "entries");
+    cJSON *sounds = cJSON_GetObjectItem(o, "sounds");
+    cJSON *sounds_expire = cJSON_GetObjectItem(o, "sounds_expire");
+    cJSON *e;
+
+    for (e = entries ? entries->child : NULL; e != NULL; e = e->next)
+    {
+        cJSON *user = cJSON_GetObjectItem(e, "user");
+        cJSON *device = cJSON_GetObjectItem(e, "device");
+        cJSON *expires = cJSON_GetObjectItem(e, "expires");
+        if (expires->valuedouble > now)
+        {
+            cpsh_strview u = { user->valuestring, strlen(user->valuestring) };
+            cpsh_strview d = { device->valuestring, strlen(device->valuestring) };
+            cpsh_vcache_put(c, u, d, cJSON_GetObjectItem(e, "valid")->type == cJSON_True, 
+                    (time_t) expires->valuedouble);
+        }
+    }
+
+    if (sounds && sounds_expire && sounds_expire->valuedouble > now)
+    {
+        size_t n = 0;
+        for (e = sounds->child; e != NULL; e = e->next)
+        {
+            strcpy(c->sounds[n++], e->valuestring);
+        }
+        c->nsounds = n;
+        c->sounds_expire = (time_t) sounds_expire->valuedouble;
+    }
+}
+
+int
+cpsh_vcache_load(cpsh_vcache *c, const char *path)
+{
+    FILE *f = fopen(path, "r");
+    struct stat st;
+    if (!f || fstat(fileno(f), &st))
+    {
+        if (f) fclose(f);
+        return CPSH_ERR_IO;
+    }
+
+    char *text = malloc(st.st_size + 1);
+    if (!text)
+    {
+        fclose(f);
+        return CPSH_ERR_NOMEM;
+    }
+    size_t len = fread(text, 1, st.st_size, f);
+    int bad = ferror(f);
+    fclose(f);
+    text[len] = '\0';
+
+    cJSON *o = bad ? NULL : cJSON_Parse(text);
+    free(text);
+    if (bad)
+    {
+        return CPSH_ERR_IO;
+    }
+    if (!o || o->type != cJSON_Object || cpsh_vcache_check_json(o))
+    {
+        cJSON_Delete(o);
+        return CPSH_ERR_MSG_FORMAT;
+    }
+
+    pthread_rwlock_wrlock(&c->lock);
+    cpsh_vcache_from_json(c, o, time(NULL));
+    pthread_rwlock_unlock(&c->lock);
+    cJSON_Delete(o);
+    return 0;
+}
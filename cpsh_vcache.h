@@ -0,0 +1,98 @@
+/*
+  Copyright (c) 2015 Christian Bjartli
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy 
+  of this software and associated documentation files (the "Software"), to deal 
+  in the Software without restriction, including without limitation the rights 
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or 
+  sell copies of the Software, and to permit persons to whom the Software is 
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all 
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE 
+  SOFTWARE.
+*/
+
+#ifndef CPSH_VCACHE_H
+#define CPSH_VCACHE_H
+
+#include <pthread.h>
+#include "cpushover.h"
+
+/* Validation cache. Remembers what the API has said about user keys, devices and sounds, so messages that are 
+   bound to fail can be turned down locally. Once installed with cpsh_set_vcache, every validation (and so every 
+   send) fails with CPSH_ERR_BAD_RECIPIENT or CPSH_ERR_BAD_SOUND when the cache knows the recipient or sound to 
+   be invalid, without any I/O. What it doesn't know lets the message through. 
+
+   Recipients are learned from cpsh_vcache_validate_user, and from the replies to sends that the API turns down 
+   for an invalid user or device. Each entry lives for valid_ttl or invalid_ttl seconds. The table is 
+   set-associative: a user and device can only be in the CPSH_VCACHE_WAYS entries of one set, and a full set 
+   makes room by dropping the entry that would expire first. Sounds are the whole list from the sounds API, 
+   kept for sounds_ttl seconds. */
+#define CPSH_VCACHE_WAYS 8
+#define CPSH_VCACHE_ENTRIES 4096        /* Default size of the table */
+#define CPSH_VCACHE_SOUNDS 128          /* Most sounds kept; a longer list isn't used to turn messages down */
+#define CPSH_VCACHE_VALID_TTL 86400
+#define CPSH_VCACHE_INVALID_TTL 3600
+#define CPSH_VCACHE_SOUNDS_TTL 86400
+
+/* Longest user key, device and sound names, as in CPSH_API_FIELDS */
+#define CPSH_VCACHE_USER_LN CPSH_USER_LN
+#define CPSH_VCACHE_DEVICE_LN CPSH_DEVICE_LN
+#define CPSH_VCACHE_SOUND_LN 16
+
+typedef struct
+{
+    char user[CPSH_VCACHE_USER_LN+1];
+    char device[CPSH_VCACHE_DEVICE_LN+1];   /* Empty for the user key as a whole */
+    char valid;
+    time_t expires;                         /* 0 if the entry is free */
+} cpsh_vcache_entry;
+
+typedef struct cpsh_vcache
+{
+    pthread_rwlock_t lock;
+    cpsh_vcache_entry *entries;
+    size_t mask;                /* Entries in the table, less one */
+    time_t valid_ttl;
+    time_t invalid_ttl;
+    time_t sounds_ttl;
+    char sounds[CPSH_VCACHE_SOUNDS][CPSH_VCACHE_SOUND_LN+1];
+    size_t nsounds;
+    time_t sounds_expire;       /* 0 if there is no usable list */
+} cpsh_vcache;
+
+/* Set up a cache of about the given number of entries (CPSH_VCACHE_ENTRIES if 0), with the default TTLs. */
+int cpsh_vcache_init(cpsh_vcache*, size_t);
+
+/* Install a cache for every validation and send to consult, or NULL for none. Set it before sending from more 
+   than one thread. */
+void cpsh_set_vcache(cpsh_vcache*);
+
+/* Check a message against what the cache knows, with no I/O. Returns 0 unless it is known to be bad. */
+int cpsh_vcache_check(cpsh_vcache*, const cpsh_message_view*);
+
+/* Check a user key, and device if not NULL, asking the API over conn unless the cache already knows. Returns 0 
+   if valid and CPSH_ERR_BAD_RECIPIENT if not; any other error is not cached. */
+int cpsh_vcache_validate_user(cpsh_vcache*, cpsh_conn*, const char*, const char*);
+
+/* Fetch the list of sounds over conn, unless the one the cache has is still fresh. */
+int cpsh_vcache_fetch_sounds(cpsh_vcache*, cpsh_conn*);
+
+/* Record that the API found the user (CPSH_INVALID_USER) or the device (CPSH_INVALID_DEVICE) invalid. */
+void cpsh_vcache_learn(cpsh_vcache*, cpsh_strview, cpsh_strview, unsigned);
+
+/* Save the unexpired entries and sounds to a JSON file, and load them back, e.g. at startup. Loading adds to 
+   what the cache holds; a missing file is CPSH_ERR_IO, a malformed one CPSH_ERR_MSG_FORMAT and adds nothing. */
+int cpsh_vcache_save(cpsh_vcache*, const char*);
+int cpsh_vcache_load(cpsh_vcache*, const char*);
+
+void cpsh_vcache_cleanup(cpsh_vcache*);
+#endif
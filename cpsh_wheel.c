@@ -0,0 +1,174 @@
+/*
+  Copyright (c) 2015 Christian Bjartli
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy 
+  of this software and associated documentation files (the "Software"), to deal 
+  in the Software without restriction, including without limitation the rights 
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or 
+  sell copies of the Software, and to permit persons to whom the Software is 
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all 
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE 
+  SOFTWARE.
+*/
+
+#include <string.h>
+#include "cpsh_wheel.h"
+
+#define SLOT_MASK (CPSH_WHEEL_SLOTS - 1)
+#define SLOT_INDEX(ticks, level) (((ticks) >> ((level) * CPSH_WHEEL_BITS)) & SLOT_MASK)
+
+/* Private prototypes */
+void cpsh_wheel_place(cpsh_wheel*, cpsh_timer*);
+void cpsh_wheel_cascade(cpsh_wheel*, int);
+
+void
+cpsh_wheel_init(cpsh_wheel *w, unsigned long long now)
+{
+    int level, slot;
+
+    w->now = now;
+    w->count = 0;
+    for (level = 0; level < CPSH_WHEEL_LEVELS; level++)
+    {
+        for (slot = 0; slot < CPSH_WHEEL_SLOTS; slot++)
+        {
+            /* Empty lists point back at their own head */
+            w->slots[level][slot].next = &w->slots[level][slot];
+            w->slots[level][slot].prev = &w->slots[level][slot];
+        }
+    }
+}
+
+/*
+   Links a timer into the slot its expiry time belongs to, relative to w->now. Level n holds 
+   timers due within CPSH_WHEEL_SLOTS^(n+1) ticks.
+ */
+void
+cpsh_wheel_place(cpsh_wheel *w, cpsh_timer *t)
+{
+    unsigned long long delta = t->expires - w->now;
+    int level = 0;
+
+    while (level < CPSH_WHEEL_LEVELS - 1 && delta >= (1ULL << ((level + 1) * CPSH_WHEEL_BITS)))
+    {
+        level++;
+    }
+
+    cpsh_timer *head = &w->slots[level][SLOT_INDEX(t->expires, level)];
+    t->next = head;
+    t->prev = head->prev;
+    head->prev->next = t;
+    head->prev = t;
+}
+
+void
+cpsh_wheel_add(cpsh_wheel *w, cpsh_timer *t, unsigned long long expires)
+{
+    if (cpsh_wheel_pending(t))
+    {
+        cpsh_wheel_del(w, t);
+    }
+
+    if (expires <= w->now)
+    {
+        expires = w->now + 1;
+    }
+    else if (expires - w->now > CPSH_WHEEL_MAX_TICKS)
+    {
+        expires = w->now + CPSH_WHEEL_MAX_TICKS;
+    }
+
+    t->expires = expires;
+    cpsh_wheel_place(w, t);
+    w->count++;
+}
+
+void
+cpsh_wheel_del(cpsh_wheel *w, cpsh_timer *t)
+{
+    if (!cpsh_wheel_pending(t))
+    {
+        return;
+    }
+
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->next = t->prev = NULL;
+    w->count--;
+}
+
+int
+cpsh_wheel_pending(const cpsh_timer *t)
+{
+    return t->next != NULL;
+}
+
+/*
+   Re-files every timer in the current slot of the given level, which moves them one or more 
+   levels down now that their time is closer.
+ */
+void
+cpsh_wheel_cascade(cpsh_wheel *w, int level)
+{
+    cpsh_timer *head = &w->slots[level][SLOT_INDEX(w->now, level)];
+    cpsh_timer *t = head->next;
+
+    /* Detach the whole list first, since timers may land back in this same slot */
+    head->next = head->prev = head;
+    while (t != head)
+    {
+        cpsh_timer *next = t->next;
+        cpsh_wheel_place(w, t);
+        t = next;
+    }
+}
+
+size_t
+cpsh_wheel_advance(cpsh_wheel *w, unsigned long long now, cpsh_timer_fn fn, void *userdata)
+{
+    size_t fired = 0;
+
+    while (w->now < now)
+    {
+        /* Nothing scheduled: skip straight to the end */
+        if (w->count == 0)
+        {
+            w->now = now;
+            break;
+        }
+
+        w->now++;
+
+        /* Crossing into a new slot on a level pulls the next slot of the level above down. Go top-down, 
+           so timers cascading from high up can keep falling through the levels below. */
+        int level = 1;
+        while (level < CPSH_WHEEL_LEVELS && SLOT_INDEX(w->now, level - 1) == 0)
+        {
+            level++;
+        }
+        while (--level > 0)
+        {
+            cpsh_wheel_cascade(w, level);
+        }
+
+        cpsh_timer *head = &w->slots[0][SLOT_INDEX(w->now, 0)];
+        while (head->next != head)
+        {
+            cpsh_timer *t = head->next;
+            cpsh_wheel_del(w, t);
+            fired++;
+            fn(t, userdata);
+        }
+    }
+
+    return fired;
+}
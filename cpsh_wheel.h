@@ -0,0 +1,70 @@
+/*
+  Copyright (c) 2015 Christian Bjartli
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy 
+  of this software and associated documentation files (the "Software"), to deal 
+  in the Software without restriction, including without limitation the rights 
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or 
+  sell copies of the Software, and to permit persons to whom the Software is 
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all 
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE 
+  SOFTWARE.
+*/
+
+#ifndef CPSH_WHEEL_H
+#define CPSH_WHEEL_H
+
+#include <stddef.h>
+
+/* Hierarchical timing wheel. Each level has CPSH_WHEEL_SLOTS slots, and each slot on level n covers 
+   CPSH_WHEEL_SLOTS^n ticks; timers on a higher level are moved down ("cascaded") as their time comes near. 
+   Timers are embedded in the caller's own structs and kept in doubly linked lists, so adding and cancelling 
+   are O(1) and advancing is amortised O(1) per timer. How long a tick is, is up to the caller. */
+#define CPSH_WHEEL_BITS 6
+#define CPSH_WHEEL_SLOTS (1 << CPSH_WHEEL_BITS)
+#define CPSH_WHEEL_LEVELS 6
+#define CPSH_WHEEL_MAX_TICKS ((1ULL << (CPSH_WHEEL_BITS * CPSH_WHEEL_LEVELS)) - 1)
+
+typedef struct cpsh_timer
+{
+    struct cpsh_timer *next;
+    struct cpsh_timer *prev;
+    unsigned long long expires;
+} cpsh_timer;
+
+typedef struct
+{
+    unsigned long long now;
+    size_t count;
+    cpsh_timer slots[CPSH_WHEEL_LEVELS][CPSH_WHEEL_SLOTS];
+} cpsh_wheel;
+
+/* Called for each timer that expires. The timer is no longer in the wheel and may be added again. */
+typedef void (*cpsh_timer_fn)(cpsh_timer*, void*);
+
+/* Start the wheel at tick now. */
+void cpsh_wheel_init(cpsh_wheel*, unsigned long long);
+
+/* Schedule a timer to expire at the given tick. Ticks already passed expire on the next advance. 
+   Timers more than CPSH_WHEEL_MAX_TICKS ahead are clamped to that. */
+void cpsh_wheel_add(cpsh_wheel*, cpsh_timer*, unsigned long long);
+
+/* Cancel a timer. Does nothing if it isn't scheduled. */
+void cpsh_wheel_del(cpsh_wheel*, cpsh_timer*);
+
+/* Non-zero if the timer is scheduled. Timers must be zeroed before first use. */
+int cpsh_wheel_pending(const cpsh_timer*);
+
+/* Move the wheel forward to tick now, calling the function for every timer that expires on the way. 
+   Returns the number of timers that expired. */
+size_t cpsh_wheel_advance(cpsh_wheel*, unsigned long long, cpsh_timer_fn, void*);
+#endif
@@ -24,6 +24,10 @@
 #include <stdlib.h>
 #include <ctype.h>
 #include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "cpushover.h"
 #include "cJSON.h"
 
@@ -36,33 +40,332 @@
 #define SIZSTRBUF (CHAR_BIT * sizeof(size_t))/3 + 2
 #define TIMETSTRBUF (CHAR_BIT * sizeof(time_t))/3 + 2
 
+/* Upper bound of the url-encoded body of a message, token and all. Printable ASCII encodes to at most 3 bytes 
+   per char; each field adds its name, '=' and '&'. */
+#define BODYLEN_CHARPT(check) 3 * CPSH_STRMAX_ ## check
+#define BODYLEN_TIMET(check) TIMETSTRBUF
+#define BODYLEN_SIGNCHAR(check) SIZSTRBUF
+#define BODYLEN_SIZET(check) SIZSTRBUF
+#define BODYLEN_ATTACH(check) 0
+#define GEN_BODYLEN(type, name, check, dep) + sizeof(#name) + 1 + BODYLEN_ ## type(check)
+#define CPSH_BODY_MAX (sizeof("token=") + CPSH_TOKEN_LN CPSH_API_FIELDS(GEN_BODYLEN) + 1)
+
+/* Most connections a cpsh_multi opens to the API, and most sends it hands to curl at once over HTTP/1 and 
+   HTTP/2 respectively. The rest wait in a queue of our own: curl revisits every handle it holds on each call, 
+   so a backlog inside curl costs CPU quadratic in its depth. */
+#define CPSH_MULTI_MAX_CONN 8
+#define CPSH_MULTI_MAX_STREAMS 64
+
+/* A send on a cpsh_multi fails after this many seconds, or once it has moved less than a byte a second for 
+   CPSH_MULTI_STALL seconds, rather than hold its place in the window for good */
+#define CPSH_MULTI_TIMEOUT 60
+#define CPSH_MULTI_STALL 30
+
+/* Room for a receipts API URL, query and all */
+#define CPSH_RECEIPT_URL_MAX (CPSH_MAX_API_URL_LN + CPSH_RECEIPT_LN + CPSH_TOKEN_LN + 32)
+
+/* Longest JSON string or number we accept in a reply. Pushover replies are small; this bounds parser memory. */
+#define CPSH_MAX_REPLY_TOKEN_LN 4096
+
 /* Private structs */ 
 typedef struct
 {
-    char *memory;
-    size_t size;
-} cpsh_memory;
+    cJSON_SAX *parser;
+    CURL *curl;
+    int status;
+    int has_status;
+    unsigned invalid;       /* CPSH_INVALID_* */
+    cpsh_response *response;
+    cpsh_receipt *receipt;
+    cpsh_sound_fn sound;
+    void *userdata;
+    int in_sounds;
+} cpsh_reply;
+
+/* A send on a cpsh_multi. Kept in a pool with its handle once done. */
+struct cpsh_transfer
+{
+    struct cpsh_transfer *next;     /* Idle or waiting list */
+    struct cpsh_transfer *all_next;
+    CURL *curl;
+    cpsh_reply reply;
+    cpsh_response response;
+    cpsh_multi_fn done;             /* NULL while idle */
+    int active;                     /* Handed to curl */
+    void *userdata;
+    cpsh_poll_fn polled;            /* Set for a receipt poll, which GETs its own URL instead of posting body */
+    void *poll_userdata;
+    cpsh_receipt receipt;
+    size_t length;
+    char user[CPSH_USER_LN+1];      /* Recipient, for the validation cache to learn from */
+    char device[CPSH_DEVICE_LN+1];
+    char body[CPSH_BODY_MAX];
+};
+
+/* Fan-out bookkeeping for one recipient */
+typedef struct
+{
+    int *result;
+    size_t *pending;
+} cpsh_fanout_slot;
 
 typedef struct
 {
     int initialized;
     char api_token[CPSH_TOKEN_LN+1];
     char api_url[CPSH_MAX_API_URL_LN+1];
+    char api_base[CPSH_MAX_API_URL_LN+1];
+    struct cpsh_vcache *vcache;
+    cpsh_check_fn vcache_check;
+    cpsh_learn_fn vcache_learn;
 } cpsh_config;
 
 /* Private prototypes */
 int pr_ascii_len(char*);
 size_t cpsh_write_callback(char*, size_t, size_t, void*);
-int cpsh_validate_input(cpsh_message*);
+int cpsh_reply_event(const cJSON_SAXEvent*, void*);
+int cpsh_perform(cpsh_conn*, cpsh_reply*);
+int cpsh_reply_start(cpsh_reply*, CURL*);
+int cpsh_reply_finish(cpsh_reply*, CURLcode);
+int pr_ascii_view(const char*, size_t);
+int cpsh_view_of_message(cpsh_message_view*, const cpsh_message*);
+void cpsh_view_of_valid(cpsh_message_view*, const cpsh_message*);
+int cpsh_validate_bounds(const cpsh_message_view*);
+int cpsh_validate_ranges(const cpsh_message_view*);
+int cpsh_conn_post(cpsh_conn*, const cpsh_message_view*, cpsh_response*);
+size_t cpsh_encode_message(char*, const cpsh_message_view*);
+size_t cpsh_encode_field(char*, const char*, const char*, size_t);
+void cpsh_prepare_view(cpsh_prepared*, const cpsh_message_view*);
+size_t cpsh_part_read(char*, size_t, size_t, void*);
+int cpsh_part_seek(void*, curl_off_t, int);
+struct cpsh_transfer *cpsh_transfer_get(cpsh_multi*);
+int cpsh_transfer_start(cpsh_multi*, struct cpsh_transfer*, cpsh_multi_fn, void*);
+void cpsh_transfer_target(struct cpsh_transfer*, const cpsh_message_view*);
+int cpsh_transfer_activate(cpsh_multi*, struct cpsh_transfer*);
+void cpsh_transfer_done(cpsh_multi*, struct cpsh_transfer*, int);
+void cpsh_multi_abort(cpsh_multi*);
+int cpsh_multi_enqueue(cpsh_multi*, const cpsh_message_view*, cpsh_multi_fn, void*);
+void cpsh_fanout_done(int, cpsh_response*, void*);
+int cpsh_receipt_url(char*, size_t, const char*);
+void cpsh_poll_done(int, cpsh_response*, void*);
+void cpsh_copy_field(char*, size_t, const cJSON_SAXEvent*);
 
 /* Global configuration */
 cpsh_config config;
 
 #ifdef CPSH_APPLICATION
+#include <stdio.h>
+#include <signal.h>
+#include "cpsh_ring.h"
+#include "cpsh_replay.h"
+#include "cpsh_vcache.h"
+
+static volatile sig_atomic_t cpsh_stop;
+
+static void
+cpsh_on_signal(int sig)
+{
+    (void)sig;
+    cpsh_stop = 1;
+}
+
+static int
+cpsh_usage(void)
+{
+    fprintf(stderr, "usage: cpushover --ring name [--slots n] [--token token] [--cache file]\n"
+            "       cpushover --replay file [--threads n] [--window n] [--token token] [--cache file]\n"
+            "  --ring sends the messages other processes submit to the shared-memory ring /dev/shm/name.\n"
+            "  --replay sends the messages in file, one JSON object per line, resuming from file.checkpoint\n"
+            "  and appending the lines it couldn't send to file.rejects.\n"
+            "  --cache keeps what the API says about recipients and sounds in file between runs, and turns\n"
+            "  down messages it knows to be bad without sending them.\n"
+            "  The API token may also be given in PUSHOVER_TOKEN.\n");
+    return 2;
+}
+
+/*
+ * Drains a submission ring over one persistent connection until told to stop
+ */
+static int
+cpsh_serve_ring(const char *name, unsigned slots)
+{
+    cpsh_ring ring;
+    cpsh_conn conn;
+    cpsh_message m;
+    cpsh_response r;
+    cpsh_ring_stats stats;
+    char buf[CPSH_MESSAGE_STRMAX];
+    int err;
+
+    if ((err = cpsh_ring_create(&ring, name, slots)))
+    {
+        fprintf(stderr, "cpushover: can't set up ring %s (error %d)\n", name, err);
+        return 1;
+    }
+    if ((err = cpsh_conn_init(&conn)))
+    {
+        cpsh_ring_close(&ring);
+        fprintf(stderr, "cpushover: can't open connection (error %d)\n", err);
+        return 1;
+    }
+
+    while (!cpsh_stop)
+    {
+        if (cpsh_ring_consume(&ring, &m, buf, 1000))
+        {
+            continue;
+        }
+        if ((err = cpsh_conn_send(&conn, &m, &r)))
+        {
+            fprintf(stderr, "cpushover: send to %s failed (error %d)\n", m.user, err);
+        }
+    }
+
+    cpsh_ring_get_stats(&ring, &stats);
+    fprintf(stderr, "cpushover: %zu left in ring, %llu refused as full, %llu abandoned, %llu corrupt\n", 
+            stats.depth, stats.full, stats.abandoned, stats.corrupt);
+    cpsh_conn_cleanup(&conn);
+    cpsh_ring_close(&ring);
+    return 0;
+}
+
+/*
+ * Sends the messages in an NDJSON file, until done or told to stop
+ */
+static int
+cpsh_serve_replay(cpsh_replay_opts *opts)
+{
+    cpsh_replay_stats stats;
+    int err;
+
+    opts->stop = &cpsh_stop;
+    err = cpsh_replay(opts, &stats);
+    fprintf(stderr, "cpushover: %llu sent, %llu rejected, %llu failed; at offset %zu (started at %zu)\n", 
+            stats.sent, stats.rejected, stats.failed, stats.offset, stats.resumed_at);
+    if (err)
+    {
+        fprintf(stderr, "cpushover: replay of %s stopped (error %d)\n", opts->path, err);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Sets up the validation cache from its snapshot, if there is one yet, and the current list of sounds
+ */
+static int
+cpsh_start_vcache(cpsh_vcache *cache, const char *path)
+{
+    cpsh_conn conn;
+    int err;
+
+    if ((err = cpsh_vcache_init(cache, 0)))
+    {
+        fprintf(stderr, "cpushover: can't set up cache (error %d)\n", err);
+        return err;
+    }
+    if ((err = cpsh_vcache_load(cache, path)) && err != CPSH_ERR_IO)
+    {
+        fprintf(stderr, "cpushover: ignoring the rest of cache %s (error %d)\n", path, err);
+    }
+
+    if (!(err = cpsh_conn_init(&conn)))
+    {
+        err = cpsh_vcache_fetch_sounds(cache, &conn);
+        cpsh_conn_cleanup(&conn);
+    }
+    if (err)
+    {
+        fprintf(stderr, "cpushover: can't fetch the list of sounds (error %d)\n", err);
+    }
+
+    cpsh_set_vcache(cache);
+    return 0;
+}
+
 int 
 main(int argc, char *argv[])
 {
-    return 0;
+    char *token = getenv("PUSHOVER_TOKEN");
+    const char *ring = NULL;
+    const char *cache_path = NULL;
+    unsigned slots = CPSH_RING_SLOTS;
+    cpsh_vcache cache;
+    cpsh_replay_opts replay;
+    int i, ret;
+
+    memset(&replay, 0, sizeof(replay));
+    for (i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--token") == 0 && i + 1 < argc)
+        {
+            token = argv[++i];
+        }
+        else if (strcmp(argv[i], "--ring") == 0 && i + 1 < argc)
+        {
+            ring = argv[++i];
+        }
+        else if (strcmp(argv[i], "--slots") == 0 && i + 1 < argc)
+        {
+            slots = strtoul(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc)
+        {
+            replay.path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+        {
+            replay.threads = strtoul(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "--window") == 0 && i + 1 < argc)
+        {
+            replay.window = strtoul(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc)
+        {
+            cache_path = argv[++i];
+        }
+        else
+        {
+            return cpsh_usage();
+        }
+    }
+    if (!ring == !replay.path || !token)
+    {
+        return cpsh_usage();
+    }
+
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+    if (cpsh_init(token))
+    {
+        fprintf(stderr, "cpushover: invalid API token\n");
+        curl_global_cleanup();
+        return 1;
+    }
+
+    if (cache_path && cpsh_start_vcache(&cache, cache_path))
+    {
+        curl_global_cleanup();
+        return 1;
+    }
+
+    signal(SIGINT, &cpsh_on_signal);
+    signal(SIGTERM, &cpsh_on_signal);
+    ret = ring ? cpsh_serve_ring(ring, slots) : cpsh_serve_replay(&replay);
+
+    if (cache_path)
+    {
+        int err;
+        cpsh_set_vcache(NULL);
+        if ((err = cpsh_vcache_save(&cache, cache_path)))
+        {
+            fprintf(stderr, "cpushover: can't save cache to %s (error %d)\n", cache_path, err);
+        }
+        cpsh_vcache_cleanup(&cache);
+    }
+
+    curl_global_cleanup();
+    return ret;
 }
 #endif /*CPSH_APPLICATION*/
 
@@ -86,6 +389,21 @@ pr_ascii_len(char *s)
     return len;
 }
 
+/* 
+   Checks if the len bytes at s are all printable ascii characters. Returns 1 if so, 0 otherwise.
+ */
+int
+pr_ascii_view(const char *s, size_t len)
+{
+    const char *end = s + len;
+    for (; s < end; s++)
+    {
+        if (!isprint((unsigned char)*s)) return 0;
+    }
+
+    return 1;
+}
+
 /*
  * Initializes data
  */
@@ -95,16 +413,60 @@ cpsh_init(char* token)
     if (pr_ascii_len(token) != CPSH_TOKEN_LN) return CPSH_ERR_INIT;
     strcpy(config.api_token, token);
     strcpy(config.api_url, CPSH_DEFAULT_API_URL);
+    strcpy(config.api_base, CPSH_DEFAULT_API_BASE);
     config.initialized = 1;
     return 0;
 }
 
 
 /*
- * Sends pushover message 
+ * Sends pushover message over a one-off connection
  */
 int 
 cpsh_send(cpsh_message *m)
+{
+    cpsh_conn conn;
+    int err;
+
+    if ((err = cpsh_conn_init(&conn)))
+    {
+        return err;
+    }
+
+    err = cpsh_conn_send(&conn, m, NULL);
+    cpsh_conn_cleanup(&conn);
+    return err;
+}
+
+/*
+ * Opens a persistent connection. Nothing goes over the wire until the first send.
+ */
+int
+cpsh_conn_init(cpsh_conn *conn)
+{
+    conn->curl = curl_easy_init();
+    if (!conn->curl)
+    {
+        return CPSH_ERR_CURL_INIT;
+    }
+    return 0;
+}
+
+void
+cpsh_conn_cleanup(cpsh_conn *conn)
+{
+    if (conn->curl)
+    {
+        curl_easy_cleanup(conn->curl);
+        conn->curl = NULL;
+    }
+}
+
+/*
+ * Sends pushover message over a persistent connection. If r is not NULL, the parsed reply is stored there.
+ */
+int
+cpsh_conn_send(cpsh_conn *conn, cpsh_message *m, cpsh_response *r)
 {
     /* Make sure library has been initialized */
     if (!config.initialized)
@@ -112,130 +474,1434 @@ cpsh_send(cpsh_message *m)
         return CPSH_ERR_INIT;
     }
 
-    /* Validate input */
+    /* Validate input, finding the string lengths on the way */
+    cpsh_message_view v;
     int input_valid;
-    if ((input_valid = cpsh_validate_input(m)))
+    if ((input_valid = cpsh_view_of_message(&v, m)) || (input_valid = cpsh_validate_bounds(&v)))
     {
         return input_valid;
     }
 
-    /* Connection */
-    CURL *curl = curl_easy_init();
-    if (!curl)
+    return cpsh_conn_post(conn, &v, r);
+}
+
+/*
+ * Same as cpsh_conn_send, for a message whose strings are views
+ */
+int
+cpsh_conn_send_view(cpsh_conn *conn, const cpsh_message_view *v, cpsh_response *r)
+{
+    if (!config.initialized)
+    {
+        return CPSH_ERR_INIT;
+    }
+
+    int input_valid;
+    if ((input_valid = cpsh_validate_view(v)))
     {
-        return CPSH_ERR_CURL_INIT;
+        return input_valid;
     }
 
-    /* Set up the message */
-    struct curl_httppost *post = NULL;
-    struct curl_httppost *last = NULL;
-    curl_formadd(&post, &last, CURLFORM_COPYNAME, "token", CURLFORM_COPYCONTENTS, \
-            config.api_token, CURLFORM_END);
+    return cpsh_conn_post(conn, v, r);
+}
+
+/*
+ * Sends a validated message. Its strings are read once, as they are encoded.
+ */
+int
+cpsh_conn_post(cpsh_conn *conn, const cpsh_message_view *v, cpsh_response *r)
+{
+    /* Attachments are streamed, which takes the newer MIME API */
+    if (v->attachment)
+    {
+        cpsh_prepared p;
+        cpsh_prepare_view(&p, v);
+        return cpsh_conn_send_prepared(conn, &p, r);
+    }
 
-    /* Generate HTTPS POST fields from structure in header file */
+    /* Reset per-request options. Live connections and TLS sessions survive this. */
+    curl_easy_reset(conn->curl);
 
     /* Dependencies */
     #define DEP_NODEP 1
-    #define DEP_NEMPTY(field) (m-> field != NULL) && (m-> field [0] != '\0')
-    #define DEP_NZERO(field) m-> field != 0
-    #define DEP_FIELDEQ(field, val) m-> field == val
-
-    /* Add fields */
-    #define GENERATE_CURLFORM(type, name, check, dep) if (DEP_ ## dep) \
-        { GENERATE_CURLFORM_ ## type(name) } 
-    #define GENERATE_CURLFORM_CHARPT(name) \
-        if ((m-> name != NULL) && (m-> name [0] != '\0')) \
-            curl_formadd(&post, &last, CURLFORM_COPYNAME, #name, CURLFORM_COPYCONTENTS, \
-                    m-> name, CURLFORM_END);
-    #define GENERATE_CURLFORM_TIMET(name) \
-        char name ## buf [TIMETSTRBUF]; \
-        snprintf(name ## buf, sizeof(name ## buf), "%li", (long) m-> name); \
-        curl_formadd(&post, &last, CURLFORM_COPYNAME, #name, CURLFORM_COPYCONTENTS, \
-                name ## buf, CURLFORM_END); 
-    #define GENERATE_CURLFORM_SIZET(name) \
-        char name ## buf [SIZSTRBUF]; \
-        snprintf(name ## buf, sizeof(name ## buf), "%li", (long) m-> name); \
-        curl_formadd(&post, &last, CURLFORM_COPYNAME, #name, CURLFORM_COPYCONTENTS, \
-                name ## buf, CURLFORM_END); 
-    #define GENERATE_CURLFORM_SIGNCHAR(name) \
-        char name ## buf [SIZSTRBUF]; \
-        snprintf(name ## buf, sizeof(name ## buf), "%li", (long) m-> name); \
-        curl_formadd(&post, &last, CURLFORM_COPYNAME, #name, CURLFORM_COPYCONTENTS, \
-                name ## buf, CURLFORM_END); 
-
-    CPSH_API_FIELDS(GENERATE_CURLFORM)
-
-    /* Prepare post */
-    cpsh_memory push_response;
-    memset(&push_response, 0, sizeof(push_response));
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&push_response);
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, &cpsh_write_callback);
-    curl_easy_setopt(curl, CURLOPT_URL, config.api_url);
-    curl_easy_setopt(curl, CURLOPT_HTTPPOST, post);
+    #define DEP_NEMPTY(field) (v-> field .len != 0)
+    #define DEP_NZERO(field) v-> field != 0
+    #define DEP_FIELDEQ(field, val) v-> field == val
+
+    /* Url-encoded into a buffer of our own rather than a form, which would take a copy of every field off 
+       the heap on each send */
+    char body[CPSH_BODY_MAX];
+    size_t length = cpsh_encode_message(body, v);
+    curl_easy_setopt(conn->curl, CURLOPT_URL, config.api_url);
+    curl_easy_setopt(conn->curl, CURLOPT_POSTFIELDS, body);
+    curl_easy_setopt(conn->curl, CURLOPT_POSTFIELDSIZE, (long) length);
 
     /* Perform HTTPS POST */
-    CURLcode res;
-    res = curl_easy_perform(curl);
-    
-    curl_formfree(post);
-    if (res != CURLE_OK)
+    cpsh_reply reply;
+    memset(&reply, 0, sizeof(reply));
+    reply.response = r;
+    int err = cpsh_perform(conn, &reply);
+
+    if (err == CPSH_ERR_BAD_RECIPIENT && config.vcache)
     {
-        return CPSH_ERR_CURL_POST;
+        config.vcache_learn(config.vcache, v->user, v->device, reply.invalid);
     }
+    return err;
+}
 
-    /* Parse JSON response */
-    cJSON *root = cJSON_Parse(push_response.memory);
-    int status = cJSON_GetObjectItem(root, "status")->valueint;
+/*
+ * Url-encodes v into out (CPSH_BODY_MAX bytes), token first. Returns the length.
+ */
+size_t
+cpsh_encode_message(char *out, const cpsh_message_view *v)
+{
+    char *p = out + cpsh_encode_field(out, "token", config.api_token, CPSH_TOKEN_LN);
 
-    /* Cleanup */
-    free(push_response.memory);
-    cJSON_Delete(root);
+    #define GENERATE_URLENC(type, name, check, dep) if (DEP_ ## dep) \
+        { GENERATE_URLENC_ ## type(name) }
+    #define GENERATE_URLENC_CHARPT(name) \
+        if (v-> name .len != 0) \
+            { *p++ = '&'; p += cpsh_encode_field(p, #name, v-> name .ptr, v-> name .len); }
+    #define GENERATE_URLENC_NUMBER(name, size) \
+        char name ## buf [size]; \
+        int name ## len = snprintf(name ## buf, sizeof(name ## buf), "%li", (long) v-> name); \
+        *p++ = '&'; \
+        p += cpsh_encode_field(p, #name, name ## buf, name ## len);
+    #define GENERATE_URLENC_TIMET(name) GENERATE_URLENC_NUMBER(name, TIMETSTRBUF)
+    #define GENERATE_URLENC_SIZET(name) GENERATE_URLENC_NUMBER(name, SIZSTRBUF)
+    #define GENERATE_URLENC_SIGNCHAR(name) GENERATE_URLENC_NUMBER(name, SIZSTRBUF)
+    #define GENERATE_URLENC_ATTACH(name)
 
-    if (status != 1)
-    { 
-        return CPSH_ERR_SEND_FAIL;
+    CPSH_API_FIELDS(GENERATE_URLENC)
+
+    return p - out;
+}
+
+/*
+ * Writes "name=value" to out, url-encoding the len bytes of value. Returns the number of bytes written.
+ */
+size_t
+cpsh_encode_field(char *out, const char *name, const char *value, size_t len)
+{
+    static const char hex[] = "0123456789ABCDEF";
+    const char *end = value + len;
+    char *p = out;
+
+    while (*name) *p++ = *name++;
+    *p++ = '=';
+    for (; value < end; value++)
+    {
+        unsigned char c = (unsigned char)*value;
+        if (isalnum(c) || c == '-' || c == '.' || c == '_' || c == '~')
+        {
+            *p++ = c;
+        }
+        else
+        {
+            *p++ = '%';
+            *p++ = hex[c >> 4];
+            *p++ = hex[c & 15];
+        }
+    }
+
+    return p - out;
+}
+
+/*
+ * Maps a file into memory to attach it
+ */
+int
+cpsh_attachment_open(cpsh_attachment *a, const char *path)
+{
+    memset(a, 0, sizeof(*a));
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        return CPSH_ERR_NOT_FOUND;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) || !S_ISREG(st.st_mode) || st.st_size < 1 || st.st_size > CPSH_ATTACHMENT_MAX)
+    {
+        close(fd);
+        return CPSH_ERR_ATTACHMENT;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        return CPSH_ERR_ATTACHMENT;
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    const char *name = strrchr(path, '/');
+    int err = cpsh_attachment_buffer(a, map, st.st_size, name ? name + 1 : path);
+    if (err)
+    {
+        munmap(map, st.st_size);
+        return err;
+    }
+    a->mapped = 1;
+    return 0;
+}
+
+/*
+ * Attaches size bytes at data, which has to stay valid until the attachment is closed
+ */
+int
+cpsh_attachment_buffer(cpsh_attachment *a, const void *data, size_t size, const char *filename)
+{
+    memset(a, 0, sizeof(*a));
+    if (size < 1 || size > CPSH_ATTACHMENT_MAX)
+    {
+        return CPSH_ERR_ATTACHMENT;
+    }
+
+    /* Go by the content rather than the name */
+    const unsigned char *d = data;
+    if (size >= 8 && memcmp(d, "\x89PNG\r\n\x1a\n", 8) == 0) a->type = "image/png";
+    else if (size >= 3 && memcmp(d, "\xff\xd8\xff", 3) == 0) a->type = "image/jpeg";
+    else if (size >= 6 && (memcmp(d, "GIF87a", 6) == 0 || memcmp(d, "GIF89a", 6) == 0)) a->type = "image/gif";
+    else if (size >= 12 && memcmp(d, "RIFF", 4) == 0 && memcmp(d + 8, "WEBP", 4) == 0) a->type = "image/webp";
+    else if (size >= 2 && memcmp(d, "BM", 2) == 0) a->type = "image/bmp";
+    else return CPSH_ERR_ATTACHMENT;
+
+    a->data = data;
+    a->size = size;
+    if (pr_ascii_len((char *)filename) > 0)
+    {
+        strncpy(a->filename, filename, CPSH_FILENAME_LN);
     }
     else
     {
-        return 0;
+        strcpy(a->filename, "attachment");
+    }
+    return 0;
+}
+
+void
+cpsh_attachment_close(cpsh_attachment *a)
+{
+    if (a->mapped)
+    {
+        munmap((void *)a->data, a->size);
     }
+    memset(a, 0, sizeof(*a));
 }
 
+/*
+ * Validates m and encodes it, to send with cpsh_conn_send_prepared
+ */
 int
-cpsh_validate_input(cpsh_message *m)
+cpsh_prepare(cpsh_prepared *p, cpsh_message *m)
 {
-    
-    #define FLAT_STLEN(a, b) STLEN, a, b
-    #define FLAT_NODEP NODEP, N/A, N/A 
-    #define FLAT_BOUND(a, b) BOUND, a, b 
-    #define FLAT_NORBOUND(a, b) NORBOUND, a, b 
-    #define VAL_STLEN(name, a, b) (pr_ascii_len(m-> name) >= a) && (pr_ascii_len(m-> name) <= b)
-    #define VAL_NODEP(name, a, b) 1
-    #define VAL_BOUND(name, a, b) ((m-> name >= a) && (m-> name <= b))
-    #define VAL_NORBOUND(name, a, b) ((m-> name == 0) || (VAL_BOUND(name, a, b)))
-    #define GEN_VAL(name, val, a, b) if (! VAL_ ## val(name, a, b)) { return CPSH_ERR_MSG_FORMAT; } 
-    #define VALIDATE_FIELDS(type, name, check, dep) EVAL(DEFER(GEN_VAL)(name, FLAT_ ## check))
+    p->nparts = 0;
+    if (!config.initialized)
+    {
+        return CPSH_ERR_INIT;
+    }
 
-    CPSH_API_FIELDS(VALIDATE_FIELDS)
-    
+    cpsh_message_view v;
+    int err;
+    if ((err = cpsh_view_of_message(&v, m)) || (err = cpsh_validate_bounds(&v)))
+    {
+        return err;
+    }
+
+    cpsh_prepare_view(p, &v);
     return 0;
 }
 
-size_t 
-cpsh_write_callback(char *ptr, size_t size, size_t nmemb, void *userdata)
+/*
+ * Copies the fields of a validated message into p's text and lists the parts to send
+ */
+void
+cpsh_prepare_view(cpsh_prepared *p, const cpsh_message_view *v)
 {
-    size_t data_length = size * nmemb;
-    cpsh_memory *mem = (cpsh_memory *)userdata;
-    mem->memory = realloc(mem->memory, mem->size + data_length + 1);
-    if (mem->memory == NULL)
+    char *text = p->text;
+    cpsh_prepared_part *part = p->parts;
+
+    memset(p->parts, 0, sizeof(p->parts));
+
+    part->field = "token";
+    part->data = config.api_token;
+    part->size = strlen(config.api_token);
+    part++;
+
+    #define GENERATE_PART(type, name, check, dep) if (DEP_ ## dep) \
+        { GENERATE_PART_ ## type(name) }
+    #define GENERATE_PART_CHARPT(name) \
+        if (v-> name .len != 0) \
+        { \
+            part->field = #name; \
+            part->data = memcpy(text, v-> name .ptr, v-> name .len); \
+            part->size = v-> name .len; \
+            text += part->size; \
+            part++; \
+        }
+    #define GENERATE_PART_NUMBER(name) \
+        part->field = #name; \
+        part->data = text; \
+        part->size = sprintf(text, "%li", (long) v-> name); \
+        text += part->size; \
+        part++;
+    #define GENERATE_PART_TIMET(name) GENERATE_PART_NUMBER(name)
+    #define GENERATE_PART_SIZET(name) GENERATE_PART_NUMBER(name)
+    #define GENERATE_PART_SIGNCHAR(name) GENERATE_PART_NUMBER(name)
+    #define GENERATE_PART_ATTACH(name) \
+        if (v-> name != NULL) \
+        { \
+            part->field = #name; \
+            part->data = v-> name ->data; \
+            part->size = v-> name ->size; \
+            part->filename = v-> name ->filename; \
+            part->type = v-> name ->type; \
+            part++; \
+        }
+
+    CPSH_API_FIELDS(GENERATE_PART)
+
+    p->nparts = part - p->parts;
+}
+
+/*
+ * Sends a prepared message. The form is put together from p's parts, which curl reads in place.
+ */
+int
+cpsh_conn_send_prepared(cpsh_conn *conn, cpsh_prepared *p, cpsh_response *r)
+{
+    curl_mime *mime;
+    curl_mimepart *mp;
+    int ok = 1;
+
+    if (p->nparts == 0)
     {
-        /* Returning a value less than data_length signals an error condition to libcurl */
-        return 0;
+        return CPSH_ERR_INIT;
+    }
+
+    curl_easy_reset(conn->curl);
+    if (!(mime = curl_mime_init(conn->curl)))
+    {
+        return CPSH_ERR_NOMEM;
+    }
+
+    for (size_t i = 0; ok && i < p->nparts; i++)
+    {
+        cpsh_prepared_part *part = &p->parts[i];
+        part->offset = 0;
+        ok = (mp = curl_mime_addpart(mime)) && curl_mime_name(mp, part->field) == CURLE_OK
+            && curl_mime_data_cb(mp, (curl_off_t) part->size, &cpsh_part_read, &cpsh_part_seek, NULL, 
+                    part) == CURLE_OK
+            && (!part->filename || curl_mime_filename(mp, part->filename) == CURLE_OK)
+            && (!part->type || curl_mime_type(mp, part->type) == CURLE_OK);
     }
 
-    memcpy(mem->memory + mem->size, ptr, data_length);
-    mem->size += data_length;
-    mem->memory[mem->size] = '\0';
+    int err = CPSH_ERR_NOMEM;
+    if (ok)
+    {
+        curl_easy_setopt(conn->curl, CURLOPT_URL, config.api_url);
+        curl_easy_setopt(conn->curl, CURLOPT_MIMEPOST, mime);
+
+        cpsh_reply reply;
+        memset(&reply, 0, sizeof(reply));
+        reply.response = r;
+        err = cpsh_perform(conn, &reply);
+        curl_easy_setopt(conn->curl, CURLOPT_MIMEPOST, NULL);
 
-    return data_length;
+        if (err == CPSH_ERR_BAD_RECIPIENT && config.vcache)
+        {
+            /* The recipient is in the prepared message's own parts */
+            cpsh_strview user = { NULL, 0 }, device = { NULL, 0 };
+            for (size_t i = 0; i < p->nparts; i++)
+            {
+                cpsh_strview field = { p->parts[i].data, p->parts[i].size };
+                if (strcmp(p->parts[i].field, "user") == 0) user = field;
+                else if (strcmp(p->parts[i].field, "device") == 0) device = field;
+            }
+            if (user.len) config.vcache_learn(config.vcache, user, device, reply.invalid);
+        }
+    }
+
+    curl_mime_free(mime);
+    return err;
+}
+
+/*
+ * Streams a part of a prepared message to curl
+ */
+size_t
+cpsh_part_read(char *buf, size_t size, size_t nitems, void *arg)
+{
+    cpsh_prepared_part *part = (cpsh_prepared_part *)arg;
+    size_t len = size * nitems;
+
+    if (len > part->size - part->offset)
+    {
+        len = part->size - part->offset;
+    }
+    memcpy(buf, part->data + part->offset, len);
+    part->offset += len;
+    return len;
+}
+
+/*
+ * Lets curl rewind a part, e.g. when it has to resend the request
+ */
+int
+cpsh_part_seek(void *arg, curl_off_t offset, int origin)
+{
+    cpsh_prepared_part *part = (cpsh_prepared_part *)arg;
+
+    if (origin != SEEK_SET || offset < 0 || (size_t) offset > part->size)
+    {
+        return CURL_SEEKFUNC_CANTSEEK;
+    }
+    part->offset = offset;
+    return CURL_SEEKFUNC_OK;
+}
+
+/*
+ * Sets up a context for concurrent sends
+ */
+int
+cpsh_multi_init(cpsh_multi *mc)
+{
+    memset(mc, 0, sizeof(*mc));
+    mc->multi = curl_multi_init();
+    if (!mc->multi)
+    {
+        return CPSH_ERR_CURL_INIT;
+    }
+
+    curl_multi_setopt(mc->multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+    curl_multi_setopt(mc->multi, CURLMOPT_MAX_HOST_CONNECTIONS, (long) CPSH_MULTI_MAX_CONN);
+    mc->limit = CPSH_MULTI_MAX_CONN;
+    return 0;
+}
+
+/*
+ * Closes the connections of mc. Sends still in flight are dropped without a callback.
+ */
+void
+cpsh_multi_cleanup(cpsh_multi *mc)
+{
+    while (mc->all)
+    {
+        struct cpsh_transfer *t = mc->all;
+        mc->all = t->all_next;
+        if (t->active)
+        {
+            curl_multi_remove_handle(mc->multi, t->curl);
+        }
+        if (t->done)
+        {
+            cJSON_SAXDelete(t->reply.parser);
+        }
+        curl_easy_cleanup(t->curl);
+        free(t);
+    }
+    mc->idle = NULL;
+    mc->waiting = mc->waiting_tail = NULL;
+    mc->active = 0;
+    mc->running = 0;
+
+    if (mc->multi)
+    {
+        curl_multi_cleanup(mc->multi);
+        mc->multi = NULL;
+    }
+}
+
+/*
+ * Validates m and starts sending it. done is called from cpsh_multi_run once the send completes.
+ */
+int
+cpsh_multi_submit(cpsh_multi *mc, cpsh_message *m, cpsh_multi_fn done, void *userdata)
+{
+    if (!config.initialized)
+    {
+        return CPSH_ERR_INIT;
+    }
+
+    cpsh_message_view v;
+    int err;
+    if ((err = cpsh_view_of_message(&v, m)) || (err = cpsh_validate_bounds(&v)))
+    {
+        return err;
+    }
+    return cpsh_multi_enqueue(mc, &v, done, userdata);
+}
+
+int
+cpsh_multi_submit_validated(cpsh_multi *mc, cpsh_message *m, cpsh_multi_fn done, void *userdata)
+{
+    if (!config.initialized)
+    {
+        return CPSH_ERR_INIT;
+    }
+
+    cpsh_message_view v;
+    cpsh_view_of_valid(&v, m);
+    return cpsh_multi_enqueue(mc, &v, done, userdata);
+}
+
+int
+cpsh_multi_submit_view(cpsh_multi *mc, const cpsh_message_view *v, cpsh_multi_fn done, void *userdata)
+{
+    if (!config.initialized)
+    {
+        return CPSH_ERR_INIT;
+    }
+
+    int err;
+    if ((err = cpsh_validate_view(v)))
+    {
+        return err;
+    }
+    return cpsh_multi_enqueue(mc, v, done, userdata);
+}
+
+/*
+ * Encodes a validated message and queues it for sending
+ */
+int
+cpsh_multi_enqueue(cpsh_multi *mc, const cpsh_message_view *v, cpsh_multi_fn done, void *userdata)
+{
+    if (v->attachment)
+    {
+        return CPSH_ERR_ATTACHMENT;
+    }
+
+    struct cpsh_transfer *t = cpsh_transfer_get(mc);
+    if (!t)
+    {
+        return CPSH_ERR_NOMEM;
+    }
+    t->length = cpsh_encode_message(t->body, v);
+    cpsh_transfer_target(t, v);
+    return cpsh_transfer_start(mc, t, done, userdata);
+}
+
+/*
+ * Takes a transfer from the pool, or makes a new one
+ */
+struct cpsh_transfer *
+cpsh_transfer_get(cpsh_multi *mc)
+{
+    struct cpsh_transfer *t = mc->idle;
+    if (t)
+    {
+        mc->idle = t->next;
+        curl_easy_reset(t->curl);
+        t->polled = NULL;
+        return t;
+    }
+
+    t = malloc(sizeof(*t));
+    if (!t)
+    {
+        return NULL;
+    }
+    t->curl = curl_easy_init();
+    if (!t->curl)
+    {
+        free(t);
+        return NULL;
+    }
+    t->done = NULL;
+    t->active = 0;
+    t->polled = NULL;
+    t->all_next = mc->all;
+    mc->all = t;
+    return t;
+}
+
+/*
+ * Sets up a transfer with its body filled in, or a receipt poll with its URL set, and hands it to curl, or 
+ * queues it if curl has enough to do. On failure the transfer goes back to the pool.
+ */
+int
+cpsh_transfer_start(cpsh_multi *mc, struct cpsh_transfer *t, cpsh_multi_fn done, void *userdata)
+{
+    memset(&t->reply, 0, sizeof(t->reply));
+    memset(&t->response, 0, sizeof(t->response));
+    t->reply.response = &t->response;
+    if (t->polled)
+    {
+        memset(&t->receipt, 0, sizeof(t->receipt));
+        t->reply.receipt = &t->receipt;
+    }
+
+    int err = cpsh_reply_start(&t->reply, t->curl);
+    if (err)
+    {
+        t->next = mc->idle;
+        mc->idle = t;
+        return err;
+    }
+
+    if (!t->polled)
+    {
+        curl_easy_setopt(t->curl, CURLOPT_URL, config.api_url);
+        curl_easy_setopt(t->curl, CURLOPT_POSTFIELDS, t->body);
+        curl_easy_setopt(t->curl, CURLOPT_POSTFIELDSIZE, (long) t->length);
+    }
+    curl_easy_setopt(t->curl, CURLOPT_PRIVATE, (void *)t);
+    curl_easy_setopt(t->curl, CURLOPT_HTTP_VERSION, (long) CURL_HTTP_VERSION_2TLS);
+    /* Rather wait for a connection that can multiplex than open another one */
+    curl_easy_setopt(t->curl, CURLOPT_PIPEWAIT, 1L);
+    curl_easy_setopt(t->curl, CURLOPT_TIMEOUT, (long) CPSH_MULTI_TIMEOUT);
+    curl_easy_setopt(t->curl, CURLOPT_LOW_SPEED_LIMIT, 1L);
+    curl_easy_setopt(t->curl, CURLOPT_LOW_SPEED_TIME, (long) CPSH_MULTI_STALL);
+
+    t->done = done;
+    t->userdata = userdata;
+    mc->running++;
+
+    if (mc->active >= mc->limit)
+    {
+        t->next = NULL;
+        if (mc->waiting_tail) mc->waiting_tail->next = t; else mc->waiting = t;
+        mc->waiting_tail = t;
+        return 0;
+    }
+
+    if ((err = cpsh_transfer_activate(mc, t)))
+    {
+        mc->running--;
+        t->done = NULL;
+        cJSON_SAXDelete(t->reply.parser);
+        t->next = mc->idle;
+        mc->idle = t;
+    }
+    return err;
+}
+
+/*
+ * Notes the recipient of a validated message on its transfer
+ */
+void
+cpsh_transfer_target(struct cpsh_transfer *t, const cpsh_message_view *v)
+{
+    memcpy(t->user, v->user.ptr, v->user.len);
+    t->user[v->user.len] = '\0';
+    if (v->device.len) memcpy(t->device, v->device.ptr, v->device.len);
+    t->device[v->device.len] = '\0';
+}
+
+int
+cpsh_transfer_activate(cpsh_multi *mc, struct cpsh_transfer *t)
+{
+    if (curl_multi_add_handle(mc->multi, t->curl) != CURLM_OK)
+    {
+        return CPSH_ERR_CURL_POST;
+    }
+    t->active = 1;
+    mc->active++;
+    return 0;
+}
+
+/*
+ * Completes a send: calls back and returns the transfer to the pool
+ */
+void
+cpsh_transfer_done(cpsh_multi *mc, struct cpsh_transfer *t, int err)
+{
+    cpsh_multi_fn done = t->done;
+    t->done = NULL;
+    mc->running--;
+
+    if (err == CPSH_ERR_BAD_RECIPIENT && config.vcache)
+    {
+        cpsh_strview user = { t->user, strlen(t->user) };
+        cpsh_strview device = { t->device, strlen(t->device) };
+        config.vcache_learn(config.vcache, user, device, t->reply.invalid);
+    }
+
+    /* Back to the pool only after the callback, which gets our copy of the response */
+    done(err, &t->response, t->userdata);
+    t->next = mc->idle;
+    mc->idle = t;
+}
+
+/*
+ * Drives the sends in flight, waiting up to timeout ms for something to happen, and calls back for each one 
+ * that has completed. If curl itself fails, every send in flight is completed with CPSH_ERR_CURL_POST.
+ */
+int
+cpsh_multi_run(cpsh_multi *mc, int timeout)
+{
+    int running;
+    CURLMcode mres = curl_multi_perform(mc->multi, &running);
+    if (mres == CURLM_OK && running)
+    {
+        mres = curl_multi_poll(mc->multi, NULL, 0, timeout, NULL);
+        if (mres == CURLM_OK) mres = curl_multi_perform(mc->multi, &running);
+    }
+    if (mres != CURLM_OK)
+    {
+        cpsh_multi_abort(mc);
+        return CPSH_ERR_CURL_POST;
+    }
+
+    CURLMsg *msg;
+    int left;
+    while ((msg = curl_multi_info_read(mc->multi, &left)))
+    {
+        if (msg->msg != CURLMSG_DONE)
+        {
+            continue;
+        }
+
+        struct cpsh_transfer *t;
+        CURLcode res = msg->data.result;
+        curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&t);
+
+        long version = 0;
+        curl_easy_getinfo(t->curl, CURLINFO_HTTP_VERSION, &version);
+        if (version >= CURL_HTTP_VERSION_2)
+        {
+            mc->limit = CPSH_MULTI_MAX_STREAMS;
+        }
+
+        curl_multi_remove_handle(mc->multi, t->curl);
+        t->active = 0;
+        mc->active--;
+
+        cpsh_transfer_done(mc, t, cpsh_reply_finish(&t->reply, res));
+    }
+
+    /* Top curl up from the queue. The next call gets them going. */
+    while (mc->waiting && mc->active < mc->limit)
+    {
+        struct cpsh_transfer *t = mc->waiting;
+        mc->waiting = t->next;
+        if (!mc->waiting) mc->waiting_tail = NULL;
+
+        if (cpsh_transfer_activate(mc, t))
+        {
+            cJSON_SAXDelete(t->reply.parser);
+            cpsh_transfer_done(mc, t, CPSH_ERR_CURL_POST);
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Fails every send in flight
+ */
+void
+cpsh_multi_abort(cpsh_multi *mc)
+{
+    struct cpsh_transfer *t;
+    for (t = mc->all; t != NULL; t = t->all_next)
+    {
+        if (!t->done)
+        {
+            continue;
+        }
+
+        if (t->active)
+        {
+            curl_multi_remove_handle(mc->multi, t->curl);
+            t->active = 0;
+            mc->active--;
+        }
+        cJSON_SAXDelete(t->reply.parser);
+        cpsh_transfer_done(mc, t, CPSH_ERR_CURL_POST);
+    }
+    mc->waiting = mc->waiting_tail = NULL;
+}
+
+/*
+ * Sends m to every recipient in r[0..n), encoding the shared part of the body once
+ */
+int
+cpsh_send_fanout(cpsh_multi *mc, cpsh_message *m, const cpsh_recipient *r, size_t n, int *results)
+{
+    if (!config.initialized)
+    {
+        return CPSH_ERR_INIT;
+    }
+
+    /* Validate everything but the recipients, which are checked one by one below */
+    static char placeholder[] = "000000000000000000000000000000";
+    cpsh_message_view shared;
+    int err;
+    if ((err = cpsh_view_of_message(&shared, m)))
+    {
+        return err;
+    }
+    shared.user.ptr = placeholder;
+    shared.user.len = sizeof(placeholder) - 1;
+    if ((err = cpsh_validate_bounds(&shared)))
+    {
+        return err;
+    }
+    if (shared.attachment)
+    {
+        return CPSH_ERR_ATTACHMENT;
+    }
+
+    char *body = malloc(CPSH_BODY_MAX);
+    if (!body)
+    {
+        return CPSH_ERR_NOMEM;
+    }
+    memset(&shared.user, 0, sizeof(shared.user));
+    memset(&shared.device, 0, sizeof(shared.device));
+    size_t length = cpsh_encode_message(body, &shared);
+
+    /* Recipients are deduplicated by user and device through an open-addressed table of indices into r */
+    size_t cap = 16, i;
+    while (cap < 2 * n) cap <<= 1;
+    size_t *first = malloc(n * sizeof(*first) + cap * sizeof(size_t));
+    cpsh_fanout_slot *slots = malloc(n * sizeof(*slots));
+    if (!first || !slots)
+    {
+        free(body);
+        free(first);
+        free(slots);
+        return CPSH_ERR_NOMEM;
+    }
+    size_t *table = first + n;
+    for (i = 0; i < cap; i++) table[i] = n;
+
+    size_t pending = 0, sent = 0;
+    for (i = 0; i < n; i++)
+    {
+        const char *user = r[i].user ? r[i].user : "";
+        const char *device = r[i].device ? r[i].device : (m->device ? m->device : "");
+
+        unsigned long h = 5381;
+        const char *c;
+        for (c = user; *c; c++) h = h * 33 + (unsigned char)*c;
+        h = h * 33 + ':';
+        for (c = device; *c; c++) h = h * 33 + (unsigned char)*c;
+
+        size_t j = h & (cap - 1);
+        first[i] = i;
+        while (table[j] != n)
+        {
+            const cpsh_recipient *o = &r[table[j]];
+            const char *odevice = o->device ? o->device : (m->device ? m->device : "");
+            if (strcmp(o->user ? o->user : "", user) == 0 && strcmp(odevice, device) == 0)
+            {
+                first[i] = table[j];
+                break;
+            }
+            j = (j + 1) & (cap - 1);
+        }
+        if (first[i] != i)
+        {
+            continue;
+        }
+        table[j] = i;
+
+        /* A stand-in message with just this recipient checks it against the same rules as any other */
+        cpsh_message probe;
+        cpsh_message_view pv;
+        memset(&probe, 0, sizeof(probe));
+        probe.user = (char *)user;
+        probe.device = (char *)device;
+        probe.message = placeholder;
+        if ((results[i] = cpsh_view_of_message(&pv, &probe)) || (results[i] = cpsh_validate_bounds(&pv)))
+        {
+            continue;
+        }
+
+        struct cpsh_transfer *t = cpsh_transfer_get(mc);
+        if (!t)
+        {
+            results[i] = CPSH_ERR_NOMEM;
+            continue;
+        }
+        memcpy(t->body, body, length);
+        t->length = length;
+        cpsh_transfer_target(t, &pv);
+        t->body[t->length++] = '&';
+        t->length += cpsh_encode_field(t->body + t->length, "user", pv.user.ptr, pv.user.len);
+        if (pv.device.len)
+        {
+            t->body[t->length++] = '&';
+            t->length += cpsh_encode_field(t->body + t->length, "device", pv.device.ptr, pv.device.len);
+        }
+
+        slots[i].result = &results[i];
+        slots[i].pending = &pending;
+        if (!(results[i] = cpsh_transfer_start(mc, t, &cpsh_fanout_done, &slots[i])))
+        {
+            pending++;
+            sent++;
+        }
+    }
+
+    /* A failure inside curl completes every send, so this always terminates */
+    while (pending)
+    {
+        cpsh_multi_run(mc, 1000);
+    }
+
+    for (i = 0; i < n; i++)
+    {
+        results[i] = results[first[i]];
+    }
+
+    free(body);
+    free(first);
+    free(slots);
+    return (n && !sent) ? CPSH_ERR_SEND_FAIL : 0;
+}
+
+void
+cpsh_fanout_done(int err, cpsh_response *r, void *userdata)
+{
+    cpsh_fanout_slot *slot = (cpsh_fanout_slot *)userdata;
+    (void)r;
+    *slot->result = err;
+    (*slot->pending)--;
+}
+
+/*
+ * Looks up the status of an emergency-priority message by its receipt
+ */
+int
+cpsh_receipt_poll(cpsh_conn *conn, const char *receipt, cpsh_receipt *info)
+{
+    if (!config.initialized)
+    {
+        return CPSH_ERR_INIT;
+    }
+
+    char url[CPSH_RECEIPT_URL_MAX];
+    int err;
+    if ((err = cpsh_receipt_url(url, sizeof(url), receipt)))
+    {
+        return err;
+    }
+
+    curl_easy_reset(conn->curl);
+    curl_easy_setopt(conn->curl, CURLOPT_URL, url);
+
+    cpsh_reply reply;
+    memset(&reply, 0, sizeof(reply));
+    memset(info, 0, sizeof(*info));
+    reply.receipt = info;
+    return cpsh_perform(conn, &reply);
+}
+
+/*
+ * Starts polling a receipt on mc. done is called from cpsh_multi_run with the result and the status.
+ */
+int
+cpsh_multi_poll_receipt(cpsh_multi *mc, const char *receipt, cpsh_poll_fn done, void *userdata)
+{
+    if (!config.initialized)
+    {
+        return CPSH_ERR_INIT;
+    }
+
+    char url[CPSH_RECEIPT_URL_MAX];
+    int err;
+    if ((err = cpsh_receipt_url(url, sizeof(url), receipt)))
+    {
+        return err;
+    }
+
+    struct cpsh_transfer *t = cpsh_transfer_get(mc);
+    if (!t)
+    {
+        return CPSH_ERR_NOMEM;
+    }
+    t->user[0] = t->device[0] = '\0';
+    t->polled = done;
+    t->poll_userdata = userdata;
+    /* curl keeps its own copy of the URL */
+    curl_easy_setopt(t->curl, CURLOPT_URL, url);
+    return cpsh_transfer_start(mc, t, &cpsh_poll_done, t);
+}
+
+void
+cpsh_poll_done(int err, cpsh_response *r, void *userdata)
+{
+    struct cpsh_transfer *t = (struct cpsh_transfer *)userdata;
+    (void)r;
+    t->polled(err, &t->receipt, t->poll_userdata);
+}
+
+/*
+ * Builds the receipts API URL for receipt, which has to be one the API could have handed out
+ */
+int
+cpsh_receipt_url(char *url, size_t size, const char *receipt)
+{
+    /* Receipts are alphanumeric; anything else has no business in the URL */
+    int len;
+    for (len = 0; receipt[len] != '\0'; len++)
+    {
+        if (!isalnum((unsigned char)receipt[len])) return CPSH_ERR_MSG_FORMAT;
+    }
+    if (len != CPSH_RECEIPT_LN) return CPSH_ERR_MSG_FORMAT;
+
+    snprintf(url, size, "%sreceipts/%s.json?token=%s", config.api_base, receipt, config.api_token);
+    return 0;
+}
+
+/*
+ * Asks the users/validate API about a user key and optional device
+ */
+int
+cpsh_user_validate(cpsh_conn *conn, const char *user, const char *device, unsigned *invalid)
+{
+    if (!config.initialized)
+    {
+        return CPSH_ERR_INIT;
+    }
+
+    /* Same rules as for a message, but the API has the last word rather than the cache */
+    cpsh_message probe;
+    cpsh_message_view v;
+    static char placeholder[] = "-";
+    int err;
+    memset(&probe, 0, sizeof(probe));
+    probe.user = (char *)user;
+    probe.device = (char *)device;
+    probe.message = placeholder;
+    if ((err = cpsh_view_of_message(&v, &probe)) || (err = cpsh_validate_ranges(&v)))
+    {
+        return err;
+    }
+
+    char body[CPSH_BODY_MAX];
+    char *p = body + cpsh_encode_field(body, "token", config.api_token, CPSH_TOKEN_LN);
+    *p++ = '&';
+    p += cpsh_encode_field(p, "user", v.user.ptr, v.user.len);
+    if (v.device.len)
+    {
+        *p++ = '&';
+        p += cpsh_encode_field(p, "device", v.device.ptr, v.device.len);
+    }
+
+    char url[CPSH_MAX_API_URL_LN + 32];
+    snprintf(url, sizeof(url), "%susers/validate.json", config.api_base);
+
+    curl_easy_reset(conn->curl);
+    curl_easy_setopt(conn->curl, CURLOPT_URL, url);
+    curl_easy_setopt(conn->curl, CURLOPT_POSTFIELDS, body);
+    curl_easy_setopt(conn->curl, CURLOPT_POSTFIELDSIZE, (long) (p - body));
+
+    cpsh_reply reply;
+    memset(&reply, 0, sizeof(reply));
+    err = cpsh_perform(conn, &reply);
+    if (invalid) *invalid = reply.invalid;
+    return err;
+}
+
+/*
+ * Lists the sounds the API takes for our token
+ */
+int
+cpsh_sounds_list(cpsh_conn *conn, cpsh_sound_fn fn, void *userdata)
+{
+    if (!config.initialized)
+    {
+        return CPSH_ERR_INIT;
+    }
+
+    char url[CPSH_MAX_API_URL_LN + CPSH_TOKEN_LN + 32];
+    snprintf(url, sizeof(url), "%ssounds.json?token=%s", config.api_base, config.api_token);
+
+    curl_easy_reset(conn->curl);
+    curl_easy_setopt(conn->curl, CURLOPT_URL, url);
+
+    cpsh_reply reply;
+    memset(&reply, 0, sizeof(reply));
+    reply.sound = fn;
+    reply.userdata = userdata;
+    return cpsh_perform(conn, &reply);
+}
+
+void
+cpsh_set_validator(struct cpsh_vcache *cache, cpsh_check_fn check, cpsh_learn_fn learn)
+{
+    config.vcache = cache;
+    config.vcache_check = check;
+    config.vcache_learn = learn;
+}
+
+/*
+ * Performs the request set up on conn, parsing the reply into *reply as it arrives 
+ */
+int
+cpsh_perform(cpsh_conn *conn, cpsh_reply *reply)
+{
+    int err;
+    if ((err = cpsh_reply_start(reply, conn->curl)))
+    {
+        return err;
+    }
+
+    return cpsh_reply_finish(reply, curl_easy_perform(conn->curl));
+}
+
+/*
+ * Sets up curl to parse the reply into *reply as it arrives
+ */
+int
+cpsh_reply_start(cpsh_reply *reply, CURL *curl)
+{
+    reply->curl = curl;
+    reply->parser = cJSON_SAXNew(CPSH_MAX_REPLY_TOKEN_LN, &cpsh_reply_event, reply);
+    if (!reply->parser)
+    {
+        return CPSH_ERR_NOMEM;
+    }
+
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)reply);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, &cpsh_write_callback);
+    return 0;
+}
+
+/*
+ * Turns the outcome of a transfer and its parsed reply into a CPSH_ERR_* code
+ */
+int
+cpsh_reply_finish(cpsh_reply *reply, CURLcode res)
+{
+    /* Only trust the status if the whole reply was well-formed */
+    int parsed = cJSON_SAXFinish(reply->parser);
+    int status = parsed ? reply->status : 0;
+    cJSON_SAXDelete(reply->parser);
+    reply->parser = NULL;
+
+    if (res != CURLE_OK)
+    {
+        return CPSH_ERR_CURL_POST;
+    }
+
+    if (status != 1)
+    { 
+        if (reply->invalid & (CPSH_INVALID_USER | CPSH_INVALID_DEVICE)) return CPSH_ERR_BAD_RECIPIENT;
+        if (reply->invalid & CPSH_INVALID_SOUND) return CPSH_ERR_BAD_SOUND;
+
+        /* A receipt is only gone if the API itself said so: a 4xx carrying a status. A 5xx, a throttled 
+           request or a reply we couldn't parse says nothing about the receipt. */
+        long code = 0;
+        curl_easy_getinfo(reply->curl, CURLINFO_RESPONSE_CODE, &code);
+        if (reply->receipt && parsed && reply->has_status && status == 0 && code >= 400 && code < 500 && code != 429)
+        {
+            return CPSH_ERR_NOT_FOUND;
+        }
+        return CPSH_ERR_SEND_FAIL;
+    }
+    else
+    {
+        return 0;
+    }
+}
+
+/*
+ * Number of bytes cpsh_message_copy needs to hold the strings of m
+ */
+size_t
+cpsh_message_strsize(const cpsh_message *m)
+{
+    size_t size = 0;
+
+    #define GEN_STRSIZE(type, name, check, dep) GEN_STRSIZE_ ## type(name)
+    #define GEN_STRSIZE_CHARPT(name) if (m-> name != NULL) size += strlen(m-> name) + 1;
+    #define GEN_STRSIZE_TIMET(name)
+    #define GEN_STRSIZE_SIGNCHAR(name)
+    #define GEN_STRSIZE_SIZET(name)
+    #define GEN_STRSIZE_ATTACH(name)
+
+    CPSH_API_FIELDS(GEN_STRSIZE)
+
+    return size;
+}
+
+/*
+ * Deep-copies src into dst, packing its strings into buf (cpsh_message_strsize(src) bytes)
+ */
+void
+cpsh_message_copy(cpsh_message *dst, const cpsh_message *src, char *buf)
+{
+    *dst = *src;
+
+    #define GEN_COPY(type, name, check, dep) GEN_COPY_ ## type(name)
+    #define GEN_COPY_CHARPT(name) if (src-> name != NULL) \
+        { dst-> name = strcpy(buf, src-> name); buf += strlen(buf) + 1; }
+    #define GEN_COPY_TIMET(name)
+    #define GEN_COPY_SIGNCHAR(name)
+    #define GEN_COPY_SIZET(name)
+    #define GEN_COPY_ATTACH(name)
+
+    CPSH_API_FIELDS(GEN_COPY)
+}
+
+/*
+ * Renders m as a JSON object. Strings that are NULL and numbers that are 0 are left out.
+ */
+char *
+cpsh_message_to_json(const cpsh_message *m)
+{
+    cJSON *o = cJSON_CreateObject();
+    if (!o)
+    {
+        return NULL;
+    }
+
+    #define GEN_TOJSON(type, name, check, dep) GEN_TOJSON_ ## type(name)
+    #define GEN_TOJSON_CHARPT(name) if (m-> name != NULL) cJSON_AddStringToObject(o, #name, m-> name);
+    #define GEN_TOJSON_NUMBER(name) if (m-> name != 0) cJSON_AddNumberToObject(o, #name, (double) m-> name);
+    #define GEN_TOJSON_TIMET(name) GEN_TOJSON_NUMBER(name)
+    #define GEN_TOJSON_SIGNCHAR(name) GEN_TOJSON_NUMBER(name)
+    #define GEN_TOJSON_SIZET(name) GEN_TOJSON_NUMBER(name)
+    #define GEN_TOJSON_ATTACH(name)
+
+    CPSH_API_FIELDS(GEN_TOJSON)
+
+    char *json = cJSON_PrintUnformatted(o);
+    cJSON_Delete(o);
+    return json;
+}
+
+/*
+ * Reads a message from a JSON object made by cpsh_message_to_json. Unknown members are ignored; members of the 
+ * wrong type, numbers out of range for their field and strings longer than the API allows are errors.
+ */
+int
+cpsh_message_from_json(cpsh_message *m, char *buf, const char *json)
+{
+    cJSON *o = cJSON_Parse(json);
+    if (!o || o->type != cJSON_Object)
+    {
+        cJSON_Delete(o);
+        return CPSH_ERR_MSG_FORMAT;
+    }
+
+    memset(m, 0, sizeof(*m));
+    cJSON *item;
+    int err = 0;
+
+    #define GEN_FROMJSON(type, name, check, dep) \
+        if (!err && (item = cJSON_GetObjectItem(o, #name))) { GEN_FROMJSON_ ## type(name, check) }
+    #define GEN_FROMJSON_CHARPT(name, check) \
+        size_t name ## len; \
+        if (item->type != cJSON_String || (name ## len = strlen(item->valuestring)) > CPSH_STRMAX_ ## check) \
+            err = CPSH_ERR_MSG_FORMAT; \
+        else \
+            { m-> name = memcpy(buf, item->valuestring, name ## len + 1); buf += name ## len + 1; }
+    #define GEN_FROMJSON_NUMBER(name, min, max) \
+        if (item->type != cJSON_Number || !(item->valuedouble >= (min) && item->valuedouble <= (max))) \
+            err = CPSH_ERR_MSG_FORMAT; \
+        else \
+            m-> name = item->valuedouble;
+    #define GEN_FROMJSON_TIMET(name, check) GEN_FROMJSON_NUMBER(name, -1e15, 1e15)
+    #define GEN_FROMJSON_SIGNCHAR(name, check) GEN_FROMJSON_NUMBER(name, SCHAR_MIN, SCHAR_MAX)
+    #define GEN_FROMJSON_SIZET(name, check) GEN_FROMJSON_NUMBER(name, 0, 1e15)
+    #define GEN_FROMJSON_ATTACH(name, check)
+
+    CPSH_API_FIELDS(GEN_FROMJSON)
+
+    cJSON_Delete(o);
+    return err;
+}
+
+int
+cpsh_validate_input(cpsh_message *m)
+{
+    cpsh_message_view v;
+    int err;
+    if ((err = cpsh_view_of_message(&v, m)))
+    {
+        return err;
+    }
+    return cpsh_validate_bounds(&v);
+}
+
+int
+cpsh_validate_view(const cpsh_message_view *v)
+{
+    #define GEN_VIEWCHARS(type, name, check, dep) GEN_VIEWCHARS_ ## type(name)
+    #define GEN_VIEWCHARS_CHARPT(name) \
+        if (!pr_ascii_view(v-> name .ptr, v-> name .len)) return CPSH_ERR_MSG_FORMAT;
+    #define GEN_VIEWCHARS_TIMET(name)
+    #define GEN_VIEWCHARS_SIGNCHAR(name)
+    #define GEN_VIEWCHARS_SIZET(name)
+    #define GEN_VIEWCHARS_ATTACH(name)
+
+    CPSH_API_FIELDS(GEN_VIEWCHARS)
+
+    return cpsh_validate_bounds(v);
+}
+
+/*
+ * Points v at the strings of m. Their lengths are found and their characters checked in the same pass.
+ */
+int
+cpsh_view_of_message(cpsh_message_view *v, const cpsh_message *m)
+{
+    #define GEN_VIEWOF(type, name, check, dep) GEN_VIEWOF_ ## type(name)
+    #define GEN_VIEWOF_CHARPT(name) \
+        int name ## len = pr_ascii_len(m-> name); \
+        if (name ## len < 0) return CPSH_ERR_MSG_FORMAT; \
+        v-> name .ptr = m-> name; \
+        v-> name .len = name ## len;
+    #define GEN_VIEWOF_TIMET(name) v-> name = m-> name;
+    #define GEN_VIEWOF_SIGNCHAR(name) v-> name = m-> name;
+    #define GEN_VIEWOF_SIZET(name) v-> name = m-> name;
+    #define GEN_VIEWOF_ATTACH(name) v-> name = m-> name;
+
+    CPSH_API_FIELDS(GEN_VIEWOF)
+
+    return 0;
+}
+
+/*
+ * Like cpsh_view_of_message, for a message whose characters have been checked already
+ */
+void
+cpsh_view_of_valid(cpsh_message_view *v, const cpsh_message *m)
+{
+    #define GEN_VIEWOFVALID(type, name, check, dep) GEN_VIEWOFVALID_ ## type(name)
+    #define GEN_VIEWOFVALID_CHARPT(name) \
+        v-> name .ptr = m-> name; \
+        v-> name .len = m-> name ? strlen(m-> name) : 0;
+    #define GEN_VIEWOFVALID_TIMET(name) v-> name = m-> name;
+    #define GEN_VIEWOFVALID_SIGNCHAR(name) v-> name = m-> name;
+    #define GEN_VIEWOFVALID_SIZET(name) v-> name = m-> name;
+    #define GEN_VIEWOFVALID_ATTACH(name) v-> name = m-> name;
+
+    CPSH_API_FIELDS(GEN_VIEWOFVALID)
+}
+
+/*
+ * Checks lengths and numeric ranges, then asks the validation cache, if any, about the recipient and sound. The 
+ * characters of the strings must already have been checked.
+ */
+int
+cpsh_validate_bounds(const cpsh_message_view *v)
+{
+    int err = cpsh_validate_ranges(v);
+    if (err || !config.vcache)
+    {
+        return err;
+    }
+    return config.vcache_check(config.vcache, v);
+}
+
+/*
+ * Checks lengths and numeric ranges alone
+ */
+int
+cpsh_validate_ranges(const cpsh_message_view *v)
+{
+    #define FLAT_STLEN(a, b) STLEN, a, b
+    #define FLAT_NODEP NODEP, N/A, N/A 
+    #define FLAT_BOUND(a, b) BOUND, a, b 
+    #define FLAT_NORBOUND(a, b) NORBOUND, a, b 
+    #define FLAT_BYTES(a, b) BYTES, a, b
+    #define VAL_STLEN(name, a, b) ((long long) v-> name .len >= a) && (v-> name .len <= b)
+    #define VAL_NODEP(name, a, b) 1
+    #define VAL_BOUND(name, a, b) ((v-> name >= a) && (v-> name <= b))
+    #define VAL_NORBOUND(name, a, b) ((v-> name == 0) || (VAL_BOUND(name, a, b)))
+    #define VAL_BYTES(name, a, b) ((v-> name == NULL) || \
+        ((v-> name ->type != NULL) && (v-> name ->size >= a) && (v-> name ->size <= b)))
+    #define GEN_VAL(name, val, a, b) if (! VAL_ ## val(name, a, b)) { return CPSH_ERR_MSG_FORMAT; } 
+    #define VALIDATE_FIELDS(type, name, check, dep) EVAL(DEFER(GEN_VAL)(name, FLAT_ ## check))
+
+    CPSH_API_FIELDS(VALIDATE_FIELDS)
+    
+    return 0;
+}
+
+size_t 
+cpsh_write_callback(char *ptr, size_t size, size_t nmemb, void *userdata)
+{
+    size_t data_length = size * nmemb;
+    cpsh_reply *reply = (cpsh_reply *)userdata;
+
+    /* A reply that doesn't parse is reported as a failed send once the transfer is done, so keep accepting data 
+       rather than aborting the transfer with an error */
+    cJSON_SAXFeed(reply->parser, ptr, data_length);
+
+    return data_length;
+}
+
+/*
+ * Picks the fields we need out of the reply as the parser reports them
+ */
+int
+cpsh_reply_event(const cJSON_SAXEvent *ev, void *userdata)
+{
+    cpsh_reply *reply = (cpsh_reply *)userdata;
+
+    /* Sound names are the members of the "sounds" object */
+    if (reply->sound && ev->depth == 1 && ev->type == cJSON_Object)
+    {
+        reply->in_sounds = ev->event == cJSON_SAX_Start && ev->key && strcmp(ev->key, "sounds") == 0;
+        return 1;
+    }
+    if (reply->in_sounds && ev->depth == 2 && ev->event == cJSON_SAX_Value)
+    {
+        reply->sound(ev->key, reply->userdata);
+        return 1;
+    }
+
+    if (ev->event != cJSON_SAX_Value || ev->depth != 1 || !ev->key)
+    {
+        return 1;
+    }
+
+    /* Reply to a message */
+    if (ev->type == cJSON_Number && strcmp(ev->key, "status") == 0)
+    {
+        reply->status = ev->valueint;
+        reply->has_status = 1;
+        if (reply->response) reply->response->status = ev->valueint;
+        if (reply->receipt) reply->receipt->status = ev->valueint;
+    }
+    else if (reply->response && ev->type == cJSON_String && strcmp(ev->key, "request") == 0)
+    {
+        cpsh_copy_field(reply->response->request, sizeof(reply->response->request), ev);
+    }
+    else if (reply->response && ev->type == cJSON_String && strcmp(ev->key, "receipt") == 0)
+    {
+        cpsh_copy_field(reply->response->receipt, sizeof(reply->response->receipt), ev);
+    }
+
+    /* Fields the API turned down are named with the value "invalid" */
+    else if (ev->type == cJSON_String && strcmp(ev->valuestring, "invalid") == 0)
+    {
+        if (strcmp(ev->key, "user") == 0) reply->invalid |= CPSH_INVALID_USER;
+        else if (strcmp(ev->key, "device") == 0) reply->invalid |= CPSH_INVALID_DEVICE;
+        else if (strcmp(ev->key, "sound") == 0) reply->invalid |= CPSH_INVALID_SOUND;
+    }
+
+    /* Reply to a receipt poll */
+    else if (reply->receipt && ev->type == cJSON_Number)
+    {
+        if (strcmp(ev->key, "acknowledged") == 0) reply->receipt->acknowledged = ev->valueint;
+        else if (strcmp(ev->key, "acknowledged_at") == 0) reply->receipt->acknowledged_at = (time_t) ev->valuedouble;
+        else if (strcmp(ev->key, "expired") == 0) reply->receipt->expired = ev->valueint;
+        else if (strcmp(ev->key, "expires_at") == 0) reply->receipt->expires_at = (time_t) ev->valuedouble;
+        else if (strcmp(ev->key, "last_delivered_at") == 0) reply->receipt->last_delivered_at = (time_t) ev->valuedouble;
+    }
+
+    return 1;
+}
+
+/*
+ * Copies a string from the reply into a fixed-size field, truncating if need be
+ */
+void
+cpsh_copy_field(char *dst, size_t size, const cJSON_SAXEvent *ev)
+{
+    size_t len = ev->valuelength < size - 1 ? ev->valuelength : size - 1;
+    memcpy(dst, ev->valuestring, len);
+    dst[len] = '\0';
 }
@@ -26,9 +26,19 @@
 #include <time.h>
 #include <curl/curl.h>
 
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
 #define CPSH_TOKEN_LN 30
+#define CPSH_RECEIPT_LN 30
+#define CPSH_USER_LN 30         /* Longest user key and device name, as in CPSH_API_FIELDS */
+#define CPSH_DEVICE_LN 25
+#define CPSH_REQUEST_LN 36
 #define CPSH_MAX_API_URL_LN 64
-#define CPSH_DEFAULT_API_URL "https://api.pushover.net/1/messages.json"
+#define CPSH_DEFAULT_API_BASE "https://api.pushover.net/1/"
+#define CPSH_DEFAULT_API_URL CPSH_DEFAULT_API_BASE "messages.json"
 
 /* Error codes */
 #define CPSH_ERR_INIT       1
@@ -40,23 +50,52 @@
 #define CPSH_ERR_CURL_INIT  7
 #define CPSH_ERR_CURL_POST  8
 #define CPSH_ERR_SEND_FAIL  9
+#define CPSH_ERR_NOMEM      10
+#define CPSH_ERR_NOT_FOUND  11
+#define CPSH_ERR_OVERLOAD   12
+#define CPSH_ERR_ATTACHMENT 13
+#define CPSH_ERR_IO         14
+#define CPSH_ERR_BAD_RECIPIENT 15  /* Rejected by the API, or the validation cache, for its user or device */
+#define CPSH_ERR_BAD_SOUND  16      /* Rejected for its sound */
+#define CPSH_ERR_DUPLICATE  17
+
+/* What the API can report as invalid in a reply */
+#define CPSH_INVALID_USER   1
+#define CPSH_INVALID_DEVICE 2
+#define CPSH_INVALID_SOUND  4
+
+/* Largest attachment the API accepts */
+#define CPSH_ATTACHMENT_MAX 5242880
+#define CPSH_FILENAME_LN 255
 
 /* This is a single-point-of-truth for the fields defined in the Pushover API. 
    We generate structs and necessary code using X-macros.  Format: 
    X(type, name, val, dep), where "type" is data type, "name" field name, "val" 
    checks done to see if input is valid, and "dep" dependencies on other fields. */
-#define CPSH_API_FIELDS(X)                                            \
-    X(CHARPT,   user,      STLEN(30, 30),       NODEP                )\
-    X(CHARPT,   message,   STLEN(1, 1024),      NODEP                )\
-    X(CHARPT,   title,     STLEN(0, 250),       NODEP                )\
-    X(CHARPT,   device,    STLEN(0, 25),        NODEP                )\
-    X(CHARPT,   url,       STLEN(0, 512),       NODEP                )\
-    X(CHARPT,   url_title, STLEN(0, 100),       NEMPTY(url)          )\
-    X(TIMET,    time,      NODEP,               NZERO(time)          )\
-    X(CHARPT,   sound,     STLEN(0, 16),        NODEP                )\
-    X(SIGNCHAR, priority,  BOUND(-2, 2),        NODEP                )\
-    X(SIZET,    retry,     NORBOUND(30, 86400), FIELDEQ(priority, 2) )\
-    X(SIZET,    expire,    NORBOUND(30, 86400), FIELDEQ(priority, 2) )
+#define CPSH_API_FIELDS(X)                                                          \
+    X(CHARPT,    user,        STLEN(30, 30),                  NODEP                )\
+    X(CHARPT,    message,     STLEN(1, 1024),                 NODEP                )\
+    X(CHARPT,    title,       STLEN(0, 250),                  NODEP                )\
+    X(CHARPT,    device,      STLEN(0, 25),                   NODEP                )\
+    X(CHARPT,    url,         STLEN(0, 512),                  NODEP                )\
+    X(CHARPT,    url_title,   STLEN(0, 100),                  NEMPTY(url)          )\
+    X(TIMET,     time,        NODEP,                          NZERO(time)          )\
+    X(CHARPT,    sound,       STLEN(0, 16),                   NODEP                )\
+    X(SIGNCHAR,  priority,    BOUND(-2, 2),                   NODEP                )\
+    X(SIZET,     retry,       NORBOUND(30, 86400),            FIELDEQ(priority, 2) )\
+    X(SIZET,     expire,      NORBOUND(30, 86400),            FIELDEQ(priority, 2) )\
+    X(ATTACH,    attachment,  BYTES(1, CPSH_ATTACHMENT_MAX),  NODEP                )
+
+/* Image attachment. Set it up with cpsh_attachment_open or cpsh_attachment_buffer, which check its size and 
+   type. Its data is never copied, so it has to stay open until every message it is attached to is sent. */
+typedef struct
+{
+    const char *data;
+    size_t size;
+    const char *type;       /* MIME type */
+    char filename[CPSH_FILENAME_LN+1];
+    int mapped;
+} cpsh_attachment;
 
 /* Message data struct. Generated X-macro-style from the above. See 
    CPSH_API_FIELDS for member names and data types. */
@@ -65,14 +104,207 @@
 #define GEN_STRUCT_TIMET(name) time_t name; 
 #define GEN_STRUCT_SIGNCHAR(name) signed char name; 
 #define GEN_STRUCT_SIZET(name) size_t name;
+#define GEN_STRUCT_ATTACH(name) const cpsh_attachment* name;
 typedef struct
 {
     CPSH_API_FIELDS(GEN_STRUCT)
 } cpsh_message;
 
+/* Most bytes cpsh_message_strsize can return for a valid message: the longest allowed strings, NULs included */
+#define CPSH_STRMAX_STLEN(a, b) (b)
+#define GEN_STRMAX(type, name, check, dep) GEN_STRMAX_ ## type(check)
+#define GEN_STRMAX_CHARPT(check) + CPSH_STRMAX_ ## check + 1
+#define GEN_STRMAX_TIMET(check)
+#define GEN_STRMAX_SIGNCHAR(check)
+#define GEN_STRMAX_SIZET(check)
+#define GEN_STRMAX_ATTACH(check)
+#define CPSH_MESSAGE_STRMAX (0 CPSH_API_FIELDS(GEN_STRMAX))
+
+/* A string given by pointer and length, so it needn't be NUL-terminated. ptr may only be NULL if len is 0. */
+typedef struct
+{
+    const char *ptr;
+    size_t len;
+} cpsh_strview;
+
+/* Message whose strings are views, e.g. into a buffer of the caller's. Otherwise the same as cpsh_message. */
+#define GEN_VIEW(type, name, check, dep) GEN_VIEW_ ## type(name) 
+#define GEN_VIEW_CHARPT(name) cpsh_strview name;
+#define GEN_VIEW_TIMET(name) time_t name; 
+#define GEN_VIEW_SIGNCHAR(name) signed char name; 
+#define GEN_VIEW_SIZET(name) size_t name;
+#define GEN_VIEW_ATTACH(name) const cpsh_attachment* name;
+typedef struct
+{
+    CPSH_API_FIELDS(GEN_VIEW)
+} cpsh_message_view;
+
+/* Reply to a sent message. The receipt is only set for emergency-priority (2) messages. */
+typedef struct
+{
+    int status;
+    char request[CPSH_REQUEST_LN+1];
+    char receipt[CPSH_RECEIPT_LN+1];
+} cpsh_response;
+
+/* Status of an emergency-priority message, as reported by the receipts API. */
+typedef struct
+{
+    int status;
+    int acknowledged;
+    time_t acknowledged_at;
+    int expired;
+    time_t expires_at;
+    time_t last_delivered_at;
+} cpsh_receipt;
+
+/* Persistent connection. Sending many messages over one keeps the connection to the API open between them. */
+typedef struct
+{
+    CURL *curl;
+} cpsh_conn;
+
+/* Form parts of a prepared message: the token and one per field. Numbers take at most 24 characters. */
+#define GEN_PARTS(type, name, check, dep) + 1
+#define CPSH_PREPARED_PARTS (1 CPSH_API_FIELDS(GEN_PARTS))
+#define CPSH_PREPARED_TEXT (CPSH_MESSAGE_STRMAX + 24 * CPSH_PREPARED_PARTS)
+
+typedef struct
+{
+    const char *field;
+    const char *data;
+    size_t size;
+    size_t offset;          /* How much of it the current send has read */
+    const char *filename;
+    const char *type;
+} cpsh_prepared_part;
+
+/* A message validated and encoded once, to send any number of times. Its text is kept here; an attachment is 
+   streamed from the caller's memory on each send. */
+typedef struct
+{
+    char text[CPSH_PREPARED_TEXT];
+    cpsh_prepared_part parts[CPSH_PREPARED_PARTS];
+    size_t nparts;
+} cpsh_prepared;
+
+/* One recipient of a fan-out. A NULL device means the message's own device field is used. */
+typedef struct
+{
+    const char *user;
+    const char *device;
+} cpsh_recipient;
+
+/* Called with each sound name the API lists */
+typedef void (*cpsh_sound_fn)(const char*, void*);
+
+/* Called as each asynchronous send completes, with its CPSH_ERR_* result and the parsed reply. */
+typedef void (*cpsh_multi_fn)(int, cpsh_response*, void*);
+
+/* Called as each asynchronous receipt poll completes, with its CPSH_ERR_* result and the receipt's status. */
+typedef void (*cpsh_poll_fn)(int, cpsh_receipt*, void*);
+
+struct cpsh_transfer;
+struct cpsh_vcache;
+
+/* A validation cache's check of a message, and how it learns a user and device the API found invalid */
+typedef int (*cpsh_check_fn)(struct cpsh_vcache*, const cpsh_message_view*);
+typedef void (*cpsh_learn_fn)(struct cpsh_vcache*, cpsh_strview, cpsh_strview, unsigned);
+
+/* Context for concurrent sends. Requests are multiplexed over HTTP/2 where the server supports it, and 
+   connections and handles are pooled between them. */
+typedef struct
+{
+    CURLM *multi;
+    struct cpsh_transfer *all;
+    struct cpsh_transfer *idle;
+    struct cpsh_transfer *waiting;
+    struct cpsh_transfer *waiting_tail;
+    size_t active;      /* Sends handed to curl */
+    size_t limit;       /* Most sends to hand curl at once. Raised once the server turns out to multiplex. */
+    size_t running;     /* Sends in flight, waiting ones included */
+} cpsh_multi;
+
 /* Init interface. Call cpsh_init with your Pushover API key */
 int cpsh_init(char*);
 
-/* Send message. */
+/* Send message. Returns 0 on success. A message the API rejects fails with CPSH_ERR_BAD_RECIPIENT if the user or 
+   device is unknown, CPSH_ERR_BAD_SOUND if the sound is, and CPSH_ERR_SEND_FAIL for anything else; earlier 
+   versions returned CPSH_ERR_SEND_FAIL for all three. The other sends below report rejections the same way. */
 int cpsh_send(cpsh_message*);
+
+/* Check a message against the Pushover API's rules without sending it. Returns 0 if it is valid. */
+int cpsh_validate_input(cpsh_message*);
+int cpsh_validate_view(const cpsh_message_view*);
+
+/* Persistent connections. cpsh_conn_send sends a message, storing the reply in the cpsh_response if it's not NULL. */
+int cpsh_conn_init(cpsh_conn*);
+int cpsh_conn_send(cpsh_conn*, cpsh_message*, cpsh_response*);
+int cpsh_conn_send_view(cpsh_conn*, const cpsh_message_view*, cpsh_response*);
+void cpsh_conn_cleanup(cpsh_conn*);
+
+/* Attachments. cpsh_attachment_open maps a file into memory; cpsh_attachment_buffer uses a buffer of the caller's, 
+   with the file name to give it. Both return CPSH_ERR_ATTACHMENT if it is too big or not an image type the API 
+   takes. */
+int cpsh_attachment_open(cpsh_attachment*, const char*);
+int cpsh_attachment_buffer(cpsh_attachment*, const void*, size_t, const char*);
+void cpsh_attachment_close(cpsh_attachment*);
+
+/* Prepared messages. The message is validated and its fields encoded once, in cpsh_prepare, after which it no 
+   longer refers to the cpsh_message; an attachment has to stay open until the last send. */
+int cpsh_prepare(cpsh_prepared*, cpsh_message*);
+int cpsh_conn_send_prepared(cpsh_conn*, cpsh_prepared*, cpsh_response*);
+
+/* Concurrent sends. cpsh_multi_submit validates and queues a message, and returns at once. cpsh_multi_run 
+   drives the sends in flight for up to timeout milliseconds, calling back as each one completes. 
+   cpsh_multi_submit_view does the same for a cpsh_message_view, whose strings are copied before it returns. 
+   cpsh_multi_submit_validated skips the validation, for a message cpsh_validate_input has already passed, e.g. 
+   on another thread. */
+int cpsh_multi_init(cpsh_multi*);
+int cpsh_multi_submit(cpsh_multi*, cpsh_message*, cpsh_multi_fn, void*);
+int cpsh_multi_submit_view(cpsh_multi*, const cpsh_message_view*, cpsh_multi_fn, void*);
+int cpsh_multi_submit_validated(cpsh_multi*, cpsh_message*, cpsh_multi_fn, void*);
+int cpsh_multi_run(cpsh_multi*, int);
+void cpsh_multi_cleanup(cpsh_multi*);
+
+/* Send one message to many recipients concurrently. The message is validated and encoded once, and a 
+   recipient listed more than once is only sent to once. results[i] gets the CPSH_ERR_* outcome for 
+   recipients[i]. Returns nonzero only if the message itself is invalid or nothing could be sent. Messages sent 
+   this way can't have attachments. */
+int cpsh_send_fanout(cpsh_multi*, cpsh_message*, const cpsh_recipient*, size_t, int*);
+
+/* Poll the status of an emergency-priority message by its receipt. Returns CPSH_ERR_NOT_FOUND if the API turned 
+   the receipt down, and CPSH_ERR_SEND_FAIL if the poll failed in a way worth retrying. cpsh_multi_poll_receipt 
+   does the same on a cpsh_multi, calling back from cpsh_multi_run. */
+int cpsh_receipt_poll(cpsh_conn*, const char*, cpsh_receipt*);
+int cpsh_multi_poll_receipt(cpsh_multi*, const char*, cpsh_poll_fn, void*);
+
+/* Ask the API whether a user key, and device if not NULL, is valid. Returns 0 if so, and CPSH_ERR_BAD_RECIPIENT 
+   if not, with the CPSH_INVALID_* flags for what is wrong stored in the unsigned if it's not NULL. */
+int cpsh_user_validate(cpsh_conn*, const char*, const char*, unsigned*);
+
+/* List the sounds the API takes, calling back with each name. */
+int cpsh_sounds_list(cpsh_conn*, cpsh_sound_fn, void*);
+
+/* Install the hooks of a validation cache for every validation and send to consult, or NULL for none. Programs 
+   call cpsh_set_vcache (see cpsh_vcache.h), so that the cache is only linked in where it is used. Set it before 
+   sending from more than one thread. */
+void cpsh_set_validator(struct cpsh_vcache*, cpsh_check_fn, cpsh_learn_fn);
+
+/* Copy a message, e.g. to queue it. cpsh_message_strsize gives the size of buffer needed for its strings, and 
+   cpsh_message_copy copies the message with its strings packed into that buffer. An attachment is shared, not 
+   copied. */
+size_t cpsh_message_strsize(const cpsh_message*);
+void cpsh_message_copy(cpsh_message*, const cpsh_message*, char*);
+
+/* Convert a message to and from a JSON object with the API's field names, e.g. to store it. cpsh_message_to_json 
+   returns a string to free() when done, or NULL if out of memory. cpsh_message_from_json packs the strings into 
+   buf, which must hold CPSH_MESSAGE_STRMAX bytes; the message still has to be validated before sending. 
+   Attachments are left out. */
+char *cpsh_message_to_json(const cpsh_message*);
+int cpsh_message_from_json(cpsh_message*, char*, const char*);
+
+#ifdef __cplusplus
+}
+#endif
 #endif
@@ -0,0 +1,414 @@
+/*
+  Copyright (c) 2015 Christian Bjartli
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy 
+  of this software and associated documentation files (the "Software"), to deal 
+  in the Software without restriction, including without limitation the rights 
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or 
+  sell copies of the Software, and to permit persons to whom the Software is 
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all 
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE 
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, 
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE 
+  SOFTWARE.
+*/
+
+#ifndef CPUSHOVER_HPP
+#define CPUSHOVER_HPP
+
+/* C++17 interface to cpushover. Header-only; link against the C library as usual. With C++20 coroutines, 
+   async_client adds sends that can be co_awaited. */
+
+#include <cstddef>
+#include <ctime>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#ifdef __cpp_impl_coroutine
+#include <atomic>
+#include <coroutine>
+#include <mutex>
+#endif
+#include "cpushover.h"
+
+namespace cpsh
+{
+
+/* Thrown by constructors that can't set up; sends report their CPSH_ERR_* code instead. */
+class error : public std::runtime_error
+{
+public:
+    explicit error(int code) : std::runtime_error("cpushover error " + std::to_string(code)), code_(code) {}
+    int code() const noexcept { return code_; }
+
+private:
+    int code_;
+};
+
+namespace detail
+{
+    constexpr bool printable(std::string_view s) noexcept
+    {
+        for (char c : s)
+        {
+            if (c < 0x20 || c > 0x7e) return false;
+        }
+        return true;
+    }
+
+    constexpr bool within(long long v, long long a, long long b) noexcept
+    {
+        return v >= a && v <= b;
+    }
+
+    template <bool Ok>
+    constexpr void require() noexcept
+    {
+        static_assert(Ok, "cpushover: constant breaks the API's rules for its field");
+    }
+
+    /* Sets the process-wide token */
+    inline void init(std::string_view token)
+    {
+        char buf[CPSH_TOKEN_LN + 1] = {};
+        if (token.size() != CPSH_TOKEN_LN)
+        {
+            throw error(CPSH_ERR_INIT);
+        }
+        token.copy(buf, CPSH_TOKEN_LN);
+
+        int err = cpsh_init(buf);
+        if (err)
+        {
+            throw error(err);
+        }
+    }
+}
+
+/* Per-field checks, the same rules as CPSH_API_FIELDS, usable in constant expressions. Rules that relate two 
+   fields (url_title needs url, retry and expire go with priority 2) are left to the full check at send time. */
+namespace valid
+{
+    #define CPSH_HPP_ARG_CHARPT std::string_view
+    #define CPSH_HPP_ARG_TIMET std::time_t
+    #define CPSH_HPP_ARG_SIGNCHAR long long
+    #define CPSH_HPP_ARG_SIZET long long
+    #define CPSH_HPP_ARG_ATTACH const cpsh_attachment*
+    #define CPSH_HPP_CHECK_STLEN(a, b) (detail::within(v.size(), a, b) && detail::printable(v))
+    #define CPSH_HPP_CHECK_BOUND(a, b) (detail::within(v, a, b))
+    #define CPSH_HPP_CHECK_NORBOUND(a, b) (v == 0 || detail::within(v, a, b))
+    #define CPSH_HPP_CHECK_NODEP ((void) v, true)
+    #define CPSH_HPP_CHECK_BYTES(a, b) \
+        (v == nullptr || (v->type != nullptr && detail::within(v->size, a, b)))
+    #define CPSH_HPP_VALID(type, name, check, dep) \
+        constexpr bool name(CPSH_HPP_ARG_ ## type v) noexcept { return CPSH_HPP_CHECK_ ## check; }
+
+    CPSH_API_FIELDS(CPSH_HPP_VALID)
+
+    constexpr bool token(std::string_view v) noexcept
+    {
+        return v.size() == CPSH_TOKEN_LN && detail::printable(v);
+    }
+}
+
+/* A constant field value, checked at compile time: msg.sound(CPSH_CONSTANT(sound, "siren")) */
+#define CPSH_CONSTANT(field, value) (cpsh::detail::require<cpsh::valid::field(value)>(), (value))
+
+/* Initialises libcurl for as long as it lives. Make one at the start of main(), before any client. */
+class global
+{
+public:
+    global() { curl_global_init(CURL_GLOBAL_DEFAULT); }
+    ~global() { curl_global_cleanup(); }
+    global(const global&) = delete;
+    global &operator=(const global&) = delete;
+};
+
+/* Builds a message over cpsh_message_view, with a setter per field. Nothing is copied: the strings given to it 
+   have to outlive its sends. Setters chain, on lvalues and temporaries alike. */
+class builder
+{
+public:
+    builder() noexcept : v_() {}
+    builder(const builder&) = delete;
+    builder &operator=(const builder&) = delete;
+    builder(builder&&) noexcept = default;
+    builder &operator=(builder&&) noexcept = default;
+
+    #define CPSH_HPP_SETTER(type, name, check, dep) CPSH_HPP_SETTER_ ## type(name)
+    #define CPSH_HPP_SETTER_OF(name, arg, assign) \
+        builder &name(arg x) & noexcept { assign; return *this; } \
+        builder &&name(arg x) && noexcept { return std::move(this-> name(x)); }
+    #define CPSH_HPP_SETTER_CHARPT(name) \
+        CPSH_HPP_SETTER_OF(name, std::string_view, (v_.name.ptr = x.data(), v_.name.len = x.size()))
+    #define CPSH_HPP_SETTER_TIMET(name) CPSH_HPP_SETTER_OF(name, std::time_t, v_.name = x)
+    #define CPSH_HPP_SETTER_SIGNCHAR(name) CPSH_HPP_SETTER_OF(name, signed char, v_.name = x)
+    #define CPSH_HPP_SETTER_SIZET(name) CPSH_HPP_SETTER_OF(name, std::size_t, v_.name = x)
+    #define CPSH_HPP_SETTER_ATTACH(name) CPSH_HPP_SETTER_OF(name, const cpsh_attachment*, v_.name = x)
+
+    CPSH_API_FIELDS(CPSH_HPP_SETTER)
+
+    /* Check the whole message, CPSH_ERR_* or 0 */
+    int validate() const noexcept { return cpsh_validate_view(&v_); }
+
+    const cpsh_message_view &view() const noexcept { return v_; }
+
+private:
+    cpsh_message_view v_;
+};
+
+/* Owns a persistent connection. The token is process-wide, as the C library keeps it in a global, so all 
+   clients have to use the same one. */
+class client
+{
+public:
+    explicit client(std::string_view token)
+    {
+        detail::init(token);
+        int err = cpsh_conn_init(&conn_);
+        if (err)
+        {
+            throw error(err);
+        }
+    }
+
+    ~client()
+    {
+        if (conn_.curl) cpsh_conn_cleanup(&conn_);
+    }
+
+    client(const client&) = delete;
+    client &operator=(const client&) = delete;
+
+    client(client &&o) noexcept : conn_(o.conn_)
+    {
+        o.conn_.curl = nullptr;
+    }
+
+    client &operator=(client &&o) noexcept
+    {
+        std::swap(conn_, o.conn_);
+        return *this;
+    }
+
+    /* Send a message, returning its CPSH_ERR_* result and storing the reply in r if given */
+    int send(const builder &m, cpsh_response *r = nullptr) noexcept
+    {
+        return cpsh_conn_send_view(&conn_, &m.view(), r);
+    }
+
+    int send(const builder &m, cpsh_response &r) noexcept
+    {
+        return send(m, &r);
+    }
+
+    cpsh_conn *native_handle() noexcept { return &conn_; }
+
+private:
+    cpsh_conn conn_ = {};
+};
+
+#ifdef __cpp_impl_coroutine
+
+/* Outcome of an awaited send */
+struct result
+{
+    int err;                /* CPSH_ERR_*, 0 on success */
+    cpsh_response response;
+};
+
+/* Resumes coroutines then and there, on the thread calling async_client::run(). To resume them elsewhere, 
+   e.g. on a thread pool, give async_client an executor of your own with the same post() member. */
+struct inline_executor
+{
+    void post(std::coroutine_handle<> h) const { h.resume(); }
+};
+
+/* Sends for coroutines: co_await client.send(msg) suspends until the reply is in, while run() drives all the 
+   sends on one thread through cpsh_multi. Sends may be awaited from any thread, and cost nothing beyond the 
+   coroutine frame until run() gets to them; at most window of them are handed to curl at once. The message is 
+   encoded when run() takes it on, so its strings have to live until the co_await returns. Destroy the client 
+   only once pending() is 0. */
+template <class Executor = inline_executor>
+class async_client
+{
+public:
+    class send_op
+    {
+    public:
+        bool await_ready() const noexcept { return false; }
+
+        void await_suspend(std::coroutine_handle<> h)
+        {
+            handle_ = h;
+            client_.enqueue(this);
+        }
+
+        result await_resume() const noexcept { return result_; }
+
+    private:
+        friend class async_client;
+
+        send_op(async_client &c, const cpsh_message_view &v) noexcept : client_(c), view_(v) {}
+
+        async_client &client_;
+        cpsh_message_view view_;
+        std::coroutine_handle<> handle_;
+        result result_ = {};
+        send_op *next_ = nullptr;
+    };
+
+    explicit async_client(std::string_view token, Executor ex = Executor(), std::size_t window = 64) 
+        : ex_(std::move(ex)), window_(window ? window : 1)
+    {
+        detail::init(token);
+        int err = cpsh_multi_init(&multi_);
+        if (err)
+        {
+            throw error(err);
+        }
+    }
+
+    ~async_client() { cpsh_multi_cleanup(&multi_); }
+
+    async_client(const async_client&) = delete;
+    async_client &operator=(const async_client&) = delete;
+
+    send_op send(const builder &m) noexcept { return send_op(*this, m.view()); }
+
+    /* Hands curl the sends awaited since last time, as far as the window allows, waits up to timeout ms for 
+       replies (or a new send), and posts the coroutines whose sends are done to the executor. Returns how many 
+       sends are still pending. */
+    std::size_t run(int timeout)
+    {
+        send_op *in;
+        {
+            std::lock_guard<std::mutex> lock(lock_);
+            in = incoming_;
+            incoming_ = nullptr;
+        }
+
+        /* incoming_ is newest first; queue them oldest first */
+        send_op *oldest = nullptr;
+        send_op *newest = in;
+        while (in)
+        {
+            send_op *op = in;
+            in = op->next_;
+            op->next_ = oldest;
+            oldest = op;
+        }
+        if (oldest)
+        {
+            if (queued_tail_) queued_tail_->next_ = oldest;
+            else queued_ = oldest;
+            queued_tail_ = newest;
+        }
+
+        while (queued_ && multi_.running < window_)
+        {
+            send_op *op = queued_;
+            queued_ = op->next_;
+            if (!queued_) queued_tail_ = nullptr;
+
+            if ((op->result_.err = cpsh_multi_submit_view(&multi_, &op->view_, &async_client::done, op)))
+            {
+                finish(op);
+            }
+        }
+
+        if (multi_.running > 0)
+        {
+            cpsh_multi_run(&multi_, timeout);
+        }
+        else if (!ready_)
+        {
+            curl_multi_poll(multi_.multi, nullptr, 0, timeout, nullptr);
+        }
+
+        /* Take each one off the list before posting it; resuming may end its frame */
+        while (ready_)
+        {
+            send_op *op = ready_;
+            ready_ = op->next_;
+            if (!ready_) ready_tail_ = nullptr;
+            pending_.fetch_sub(1, std::memory_order_relaxed);
+            ex_.post(op->handle_);
+        }
+        return pending();
+    }
+
+    std::size_t pending() const noexcept { return pending_.load(std::memory_order_relaxed); }
+
+private:
+    void enqueue(send_op *op)
+    {
+        pending_.fetch_add(1, std::memory_order_relaxed);
+        {
+            std::lock_guard<std::mutex> lock(lock_);
+            op->next_ = incoming_;
+            incoming_ = op;
+        }
+        curl_multi_wakeup(multi_.multi);
+    }
+
+    void finish(send_op *op) noexcept
+    {
+        op->next_ = nullptr;
+        if (ready_tail_) ready_tail_->next_ = op;
+        else ready_ = op;
+        ready_tail_ = op;
+    }
+
+    static void done(int err, cpsh_response *r, void *userdata)
+    {
+        send_op *op = static_cast<send_op *>(userdata);
+        op->result_.err = err;
+        if (r) op->result_.response = *r;
+        op->client_.finish(op);
+    }
+
+    Executor ex_;
+    std::size_t window_;
+    cpsh_multi multi_ = {};
+    std::mutex lock_;
+    send_op *incoming_ = nullptr;       /* Awaited, not yet seen by run(); newest first */
+    send_op *queued_ = nullptr;         /* Waiting for room in the window */
+    send_op *queued_tail_ = nullptr;
+    send_op *ready_ = nullptr;          /* Done, to be posted */
+    send_op *ready_tail_ = nullptr;
+    std::atomic<std::size_t> pending_{0};
+};
+
+#endif
+
+}
+
+/* The generators above are only for this header */
+#undef CPSH_HPP_ARG_CHARPT
+#undef CPSH_HPP_ARG_TIMET
+#undef CPSH_HPP_ARG_SIGNCHAR
+#undef CPSH_HPP_ARG_SIZET
+#undef CPSH_HPP_ARG_ATTACH
+#undef CPSH_HPP_CHECK_STLEN
+#undef CPSH_HPP_CHECK_BOUND
+#undef CPSH_HPP_CHECK_NORBOUND
+#undef CPSH_HPP_CHECK_NODEP
+#undef CPSH_HPP_CHECK_BYTES
+#undef CPSH_HPP_VALID
+#undef CPSH_HPP_SETTER
+#undef CPSH_HPP_SETTER_OF
+#undef CPSH_HPP_SETTER_CHARPT
+#undef CPSH_HPP_SETTER_TIMET
+#undef CPSH_HPP_SETTER_SIGNCHAR
+#undef CPSH_HPP_SETTER_SIZET
+#undef CPSH_HPP_SETTER_ATTACH
+#endif